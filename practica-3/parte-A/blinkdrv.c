@@ -20,6 +20,18 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/miscdevice.h>
+#include <linux/log2.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,1)
 #define __cconst__ const
@@ -27,21 +39,117 @@
 #define __cconst__ 
 #endif
 
+#include "blinkdrv.h"
+
 MODULE_LICENSE("GPL");
 
+/* Use the multi-LED feature report when the device accepts it */
+static bool multi_led = true;
+module_param(multi_led, bool, 0444);
+MODULE_PARM_DESC(multi_led, "Send whole frames in one multi-LED report if supported");
+
+/* Control transfers that may be pending on a device at the same time */
+static unsigned int queue_depth = 16;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Max. control URBs in flight per device when coalesce=0");
+
+/*
+ * Latest-wins: keep at most one frame in flight per device and replace a
+ * pending frame with the newer one instead of queueing both
+ */
+static bool coalesce = true;
+module_param(coalesce, bool, 0644);
+MODULE_PARM_DESC(coalesce, "Send only the newest pending frame when writes outpace the device (default: Y)");
+
+/* Merge mode: LEDs not mentioned in a write keep their color */
+static bool merge = false;
+module_param(merge, bool, 0644);
+MODULE_PARM_DESC(merge, "Keep the current color of LEDs not given in a write (default: switch them off)");
+
+/* LEDs of every device, 0 to tell them from the product variant */
+static unsigned int nr_leds = 0;
+module_param(nr_leds, uint, 0444);
+MODULE_PARM_DESC(nr_leds, "LEDs per device (1-64, default 0: detect them)");
+
 /* Get a minor range for your devices from the usb maintainer */
 #define USB_BLINK_MINOR_BASE	0 
 
+/*
+ * Buckets of the USB round-trip latency histogram: bucket 0 counts
+ * transfers under 64us, bucket i those under 64us << i, the last one
+ * everything slower
+ */
+#define BLINK_LAT_BUCKETS	12
+#define BLINK_LAT_MIN_SHIFT	6
+
 /* Structure to hold all of our device specific stuff */
 struct usb_blink {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
 	struct kref		kref;
+	unsigned int		nr_leds;		/* LEDs driven by the device (io_mutex) */
+	int			multi_report;		/* index in blink_multi_reports, -1 if unsupported */
+	struct usb_anchor	submitted;		/* URBs in flight, waited for by fsync() */
+	atomic_t		in_flight;		/* how many of them */
+	wait_queue_head_t	wq;			/* writers waiting for room in the queue */
+	spinlock_t		err_lock;		/* lock for errors */
+	int			errors;			/* last failed transfer, reported by the next write */
+	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
+	bool			disconnected;
+	unsigned int		colors[BLINK_MAX_LEDS];	/* last color queued for each LED (io_mutex) */
+	atomic_t		colors_gen;		/* bumped whenever the LEDs may not show dev->colors */
+	int			colors_synced;		/* colors_gen when dev->colors was last known (io_mutex) */
+
+	/* Mailbox with the newest frame not sent yet, see blink_post_frame() */
+	spinlock_t		mbox_lock;
+	bool			mbox_full;
+	bool			mbox_merge;		/* only the LEDs in mbox_set are given */
+	unsigned int		mbox_colors[BLINK_MAX_LEDS];
+	DECLARE_BITMAP(mbox_set, BLINK_MAX_LEDS);
+	struct work_struct	mbox_work;
+	u64			frames_dropped;		/* replaced (not merged) in the mailbox before being sent */
+
+	struct list_head	node;			/* in blink_devices */
+
+	/* Transfer statistics, in sysfs next to nr_leds */
+	atomic64_t		frames_sent;		/* frames that needed at least one transfer */
+	atomic64_t		transfers;		/* reports the device acknowledged */
+	atomic64_t		bytes;			/* and their size */
+	atomic64_t		xfer_errors;		/* reports that failed or could not be submitted */
+	atomic64_t		latency[BLINK_LAT_BUCKETS]; /* submit to completion, see latency_show() */
+
+	/* Animation engine, see blink_anim_work() */
+	struct mutex		anim_lock;		/* protects the fields below */
+	struct blink_anim_data	*anim;			/* animation loaded or playing */
+	struct blink_anim_data	*anim_next;		/* replaces anim at the next frame boundary */
+	bool			anim_running;
+	unsigned int		anim_frame;		/* next frame to show */
+	unsigned int		anim_loop;		/* times anim has been played so far */
+	ktime_t			anim_deadline;		/* when the next frame is due */
+	struct hrtimer		anim_timer;
+	struct work_struct	anim_work;
+
+	u8			*fb;			/* BLINK_FB_SIZE bytes, mmap()'ed by user space */
 };
 #define to_blink_dev(d) container_of(d, struct usb_blink, kref)
 
+/* Animation copied in from struct blink_anim */
+struct blink_anim_data {
+	unsigned int	nr_frames;
+	unsigned int	nr_leds;
+	unsigned int	repeat;
+	u32		*durations;	/* ms, nr_frames entries */
+	u32		*colors;	/* nr_frames * nr_leds entries */
+};
+
 static struct usb_driver blink_driver;
 
+/* Attached devices, for the broadcast node (blinkstick_all) */
+static LIST_HEAD(blink_devices);
+static DEFINE_MUTEX(blink_devices_lock);
+
+static void blink_anim_stop(struct usb_blink *dev);
+
 /* 
  * Free up the usb_blink structure and
  * decrement the usage count associated with the usb device 
@@ -50,6 +158,13 @@ static void blink_delete(struct kref *kref)
 {
 	struct usb_blink *dev = to_blink_dev(kref);
 
+	/* An ioctl may have restarted the animation after disconnect() */
+	blink_anim_stop(dev);
+	cancel_work_sync(&dev->mbox_work);
+	kvfree(dev->anim);
+	kvfree(dev->anim_next);
+	/* Pages still mapped by a process are freed when it unmaps them */
+	free_page((unsigned long)dev->fb);
 	usb_put_dev(dev->udev);
 	kfree(dev);
 }
@@ -100,120 +215,1028 @@ static int blink_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-
-#define NR_LEDS 8
 #define NR_BYTES_BLINK_MSG 6
 
+/* Report that sets a single LED: [5, channel, index, R, G, B] */
+#define BLINK_REPORT_LED	5
+
+/*
+ * Multi-LED reports: [id, channel, G0, R0, B0, G1, R1, B1, ...] carry the
+ * colors of the first nr_leds LEDs of the strip in a single transfer
+ */
+static const struct {
+	u8 id;
+	unsigned int nr_leds;
+} blink_multi_reports[] = {
+	{ 6, 8 },
+	{ 7, 16 },
+	{ 8, 32 },
+	{ 9, 64 },
+};
+
+#define BLINK_MULTI_REPORT_SIZE(n)	(2 + 3 * (n))
+
+/* Timeout used when probing for the multi-LED report */
+#define BLINK_PROBE_TIMEOUT_MS	1000
+
+/* How long fsync() waits for the queued frames to reach the device */
+#define BLINK_FSYNC_TIMEOUT_MS	5000
+
+/*
+ * Transfers a broadcast waits for, possibly on several devices. 'pending'
+ * counts the URBs not completed yet plus one held by the submitter until
+ * everything is submitted; 'refs' keeps the structure alive for the URBs
+ * and for the submitter, which may give up waiting before they complete.
+ */
+struct blink_sync {
+	atomic_t		pending;
+	atomic_t		refs;
+	struct completion	done;
+	int			error;		/* first failed transfer */
+};
+
+static void blink_sync_put(struct blink_sync *sync)
+{
+	if (atomic_dec_and_test(&sync->refs))
+		kfree(sync);
+}
+
+/* A control transfer in flight: setup packet and report, freed on completion */
+struct blink_xfer {
+	struct usb_blink	*dev;
+	struct blink_sync	*sync;		/* NULL if nobody waits for this one */
+	ktime_t			submitted;	/* for the latency histogram */
+	struct usb_ctrlrequest	setup;
+	u8			data[];
+};
+
+/*
+ * Called by the USB core (in interrupt context) when a report has been
+ * sent. Errors are kept in dev->errors and returned by the next write()
+ * or fsync().
+ */
+static void blink_ctrl_callback(struct urb *urb)
+{
+	struct blink_xfer *xfer = urb->context;
+	struct usb_blink *dev = xfer->dev;
+	s64 us = ktime_us_delta(ktime_get(), xfer->submitted);
+	unsigned int bucket = 0;
+
+	if (us >> BLINK_LAT_MIN_SHIFT)
+		bucket = min_t(unsigned int, ilog2((u64)us >> BLINK_LAT_MIN_SHIFT) + 1,
+			       BLINK_LAT_BUCKETS - 1);
+
+	if (urb->status == 0) {
+		atomic64_inc(&dev->transfers);
+		atomic64_add(urb->actual_length, &dev->bytes);
+		atomic64_inc(&dev->latency[bucket]);
+	}
+
+	if (urb->status) {
+		/* Unlinked on purpose (disconnect), not a device error */
+		if (!(urb->status == -ENOENT ||
+		      urb->status == -ECONNRESET ||
+		      urb->status == -ESHUTDOWN)) {
+			dev_err(&dev->udev->dev,
+				"%s - nonzero write status received: %d\n",
+				__func__, urb->status);
+			atomic64_inc(&dev->xfer_errors);
+		}
+
+		spin_lock(&dev->err_lock);
+		dev->errors = urb->status;
+		spin_unlock(&dev->err_lock);
+
+		/* The LEDs may not show dev->colors: resend everything next time */
+		atomic_inc(&dev->colors_gen);
+	}
+
+	if (xfer->sync) {
+		if (urb->status)
+			cmpxchg(&xfer->sync->error, 0, urb->status);
+		if (atomic_dec_and_test(&xfer->sync->pending))
+			complete(&xfer->sync->done);
+		blink_sync_put(xfer->sync);
+	}
+
+	kfree(xfer);
+
+	/* Last transfer done: the device can take the frame in the mailbox */
+	if (atomic_dec_and_test(&dev->in_flight) && READ_ONCE(dev->mbox_full))
+		queue_work(system_highpri_wq, &dev->mbox_work);
+	wake_up_interruptible(&dev->wq);
+}
+
+/*
+ * Queue one feature report (its first byte is the report id) on endpoint
+ * 0 without waiting for it. The caller holds io_mutex, so reports reach
+ * the device in the order they were queued. If 'sync' is given, the
+ * transfer is counted in it.
+ */
+static int blink_submit_report(struct usb_blink *dev, const u8 *report, size_t len,
+			       struct blink_sync *sync)
+{
+	struct blink_xfer *xfer;
+	struct urb *urb;
+	int retval;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return -ENOMEM;
+
+	/* Must be kmalloc'ed: the USB core maps setup and data for DMA */
+	xfer = kmalloc(sizeof(*xfer) + len, GFP_KERNEL);
+	if (!xfer) {
+		usb_free_urb(urb);
+		return -ENOMEM;
+	}
+
+	xfer->dev = dev;
+	xfer->sync = sync;
+	xfer->setup.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_DEVICE;
+	xfer->setup.bRequest = USB_REQ_SET_CONFIGURATION;
+	xfer->setup.wValue = cpu_to_le16(report[0]);	/* Report id */
+	xfer->setup.wIndex = cpu_to_le16(0);
+	xfer->setup.wLength = cpu_to_le16(len);
+	memcpy(xfer->data, report, len);
+
+	usb_fill_control_urb(urb, dev->udev,
+			     usb_sndctrlpipe(dev->udev, 0), /* Endpoint #0 */
+			     (unsigned char *)&xfer->setup,
+			     xfer->data, len,
+			     blink_ctrl_callback, xfer);
+
+	usb_anchor_urb(urb, &dev->submitted);
+	atomic_inc(&dev->in_flight);
+	if (sync) {
+		atomic_inc(&sync->pending);
+		atomic_inc(&sync->refs);
+	}
+
+	xfer->submitted = ktime_get();
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval) {
+		atomic64_inc(&dev->xfer_errors);
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		usb_unanchor_urb(urb);
+		atomic_dec(&dev->in_flight);
+		if (sync) {
+			/* The submitter still holds its own count: never 0 here */
+			atomic_dec(&sync->pending);
+			atomic_dec(&sync->refs);
+		}
+		kfree(xfer);
+	}
+
+	/* The USB core keeps its own reference until the URB completes */
+	usb_free_urb(urb);
+	return retval;
+}
+
+/* Number of reports needed to send a frame to the device */
+static unsigned int blink_frame_reports(struct usb_blink *dev)
+{
+	return dev->multi_report >= 0 ? 1 : dev->nr_leds;
+}
+
+/* Fill in a BLINK_REPORT_LED report: [5, 0, index, R, G, B] */
+static void blink_led_report(unsigned char *msg, unsigned int led, unsigned int color)
+{
+	msg[0] = BLINK_REPORT_LED;		/* Command */
+	msg[1] = 0x00;				/* Reserved */
+	msg[2] = led;				/* LED number */
+	msg[3] = (color >> 16) & 0xff;		/* R */
+	msg[4] = (color >> 8) & 0xff;		/* G */
+	msg[5] = color & 0xff;			/* B */
+}
+
+/*
+ * Queue a frame (one 0xRRGGBB color per LED), sending only the LEDs whose
+ * color differs from dev->colors. A single changed LED goes in one
+ * BLINK_REPORT_LED report; several of them in one multi-LED report if the
+ * device supports it, one BLINK_REPORT_LED report each otherwise. If
+ * 'set' is not NULL, only the LEDs in it are taken from 'colors' and the
+ * rest keep their current color. Must hold io_mutex.
+ */
+static int blink_submit_frame(struct usb_blink *dev, const unsigned int *colors,
+			      const unsigned long *set, struct blink_sync *sync)
+{
+	unsigned char msg[BLINK_MULTI_REPORT_SIZE(BLINK_MAX_LEDS)];
+	unsigned int frame[BLINK_MAX_LEDS] = {0};
+	DECLARE_BITMAP(dirty, BLINK_MAX_LEDS);
+	int gen = atomic_read(&dev->colors_gen);
+	bool valid = dev->colors_synced == gen;
+	unsigned int nr_dirty;
+	int retval = 0;
+	int i;
+
+	bitmap_zero(dirty, BLINK_MAX_LEDS);
+	for (i = 0; i < dev->nr_leds; i++) {
+		frame[i] = (set && !test_bit(i, set)) ? dev->colors[i] : colors[i];
+		if (!valid || frame[i] != dev->colors[i])
+			__set_bit(i, dirty);
+	}
+
+	nr_dirty = bitmap_weight(dirty, BLINK_MAX_LEDS);
+	if (nr_dirty == 0)
+		return 0;	/* Nothing changed */
+
+	/*
+	 * Updated before submitting, and marked in sync with the generation
+	 * read above: a transfer that fails from then on, even one of these
+	 * very reports, bumps colors_gen and the next frame is sent in full
+	 */
+	memcpy(dev->colors, frame, sizeof(frame));
+	dev->colors_synced = gen;
+
+	if (dev->multi_report >= 0 && nr_dirty > 1) {
+		size_t len = BLINK_MULTI_REPORT_SIZE(blink_multi_reports[dev->multi_report].nr_leds);
+
+		memset(msg, 0, len);
+		msg[0] = blink_multi_reports[dev->multi_report].id;
+		msg[1] = 0;	/* Channel */
+		for (i = 0; i < dev->nr_leds; i++) {
+			msg[2 + 3 * i] = (frame[i] >> 8) & 0xff;	/* G */
+			msg[3 + 3 * i] = (frame[i] >> 16) & 0xff;	/* R */
+			msg[4 + 3 * i] = frame[i] & 0xff;		/* B */
+		}
+		retval = blink_submit_report(dev, msg, len, sync);
+	} else {
+		for_each_set_bit(i, dirty, BLINK_MAX_LEDS) {
+			blink_led_report(msg, i, frame[i]);
+			if ((retval = blink_submit_report(dev, msg, NR_BYTES_BLINK_MSG, sync)))
+				break;
+		}
+	}
+
+	if (retval)
+		atomic_inc(&dev->colors_gen);
+	else
+		atomic64_inc(&dev->frames_sent);
+	return retval;
+}
+
+/* Return (and clear) the error of a transfer that failed since the last call */
+static int blink_take_error(struct usb_blink *dev)
+{
+	int retval = 0;
+
+	spin_lock_irq(&dev->err_lock);
+	if (dev->errors) {
+		/* any error is reported once */
+		retval = dev->errors == -EPIPE ? -EPIPE : -EIO;
+		dev->errors = 0;
+	}
+	spin_unlock_irq(&dev->err_lock);
+
+	return retval;
+}
+
+/* True when a frame of 'needed' reports fits in the queue */
+static bool blink_queue_has_room(struct usb_blink *dev, unsigned int needed)
+{
+	unsigned int in_flight = atomic_read(&dev->in_flight);
+
+	/* A frame larger than the whole queue is let through when it is empty */
+	return in_flight == 0 || in_flight + needed <= queue_depth;
+}
+
+/*
+ * Sends the frame left in the mailbox once the previous one has been
+ * fully transferred. Queued by blink_post_frame() and, when the last URB
+ * of a frame completes, by blink_ctrl_callback(); so the device gets
+ * frames as fast as it accepts them, and only the newest one.
+ */
+static void blink_mbox_work(struct work_struct *work)
+{
+	struct usb_blink *dev = container_of(work, struct usb_blink, mbox_work);
+	unsigned int colors[BLINK_MAX_LEDS];
+	DECLARE_BITMAP(set, BLINK_MAX_LEDS);
+	bool merge_frame;
+	int retval;
+
+	mutex_lock(&dev->io_mutex);
+
+	/* disconnect() was called, or the previous frame is still on its way */
+	if (dev->disconnected || atomic_read(&dev->in_flight) > 0)
+		goto out;
+
+	spin_lock_irq(&dev->mbox_lock);
+	if (!dev->mbox_full) {
+		spin_unlock_irq(&dev->mbox_lock);
+		goto out;
+	}
+	memcpy(colors, dev->mbox_colors, sizeof(colors));
+	bitmap_copy(set, dev->mbox_set, BLINK_MAX_LEDS);
+	merge_frame = dev->mbox_merge;
+	dev->mbox_full = false;
+	spin_unlock_irq(&dev->mbox_lock);
+
+	retval = blink_submit_frame(dev, colors, merge_frame ? set : NULL, NULL);
+	if (retval) {
+		/* Reported by the next write(), as transfer errors are */
+		spin_lock_irq(&dev->err_lock);
+		dev->errors = retval;
+		spin_unlock_irq(&dev->err_lock);
+	}
+
+	/* fsync() may be waiting for the mailbox to empty */
+	wake_up_interruptible(&dev->wq);
+out:
+	mutex_unlock(&dev->io_mutex);
+}
+
+/*
+ * Leave a frame in the mailbox of the device, never blocking. A frame
+ * still pending there is replaced (counted in frames_dropped); with
+ * 'set', the new colors are merged onto it instead, so LEDs the pending
+ * frame changed are not lost and nothing is counted.
+ */
+static int blink_post_frame(struct usb_blink *dev, const unsigned int *colors,
+			    const unsigned long *set)
+{
+	unsigned long flags;
+	int i;
+
+	if (READ_ONCE(dev->disconnected))
+		return -ENODEV;
+
+	spin_lock_irqsave(&dev->mbox_lock, flags);
+
+	if (!set) {
+		/* Only a full frame loses the one it replaces */
+		if (dev->mbox_full)
+			dev->frames_dropped++;
+		memcpy(dev->mbox_colors, colors, sizeof(dev->mbox_colors));
+		dev->mbox_merge = false;
+	} else {
+		if (!dev->mbox_full) {
+			bitmap_zero(dev->mbox_set, BLINK_MAX_LEDS);
+			dev->mbox_merge = true;
+		}
+		/* Over a full frame the result is still a full frame */
+		for_each_set_bit(i, set, BLINK_MAX_LEDS)
+			dev->mbox_colors[i] = colors[i];
+		bitmap_or(dev->mbox_set, dev->mbox_set, set, BLINK_MAX_LEDS);
+	}
+	dev->mbox_full = true;
+
+	spin_unlock_irqrestore(&dev->mbox_lock, flags);
+
+	queue_work(system_highpri_wq, &dev->mbox_work);
+	return 0;
+}
+
+/* Nothing pending in the mailbox nor in flight (for fsync) */
+static bool blink_idle(struct usb_blink *dev)
+{
+	return !READ_ONCE(dev->mbox_full) && atomic_read(&dev->in_flight) == 0;
+}
+
+/*
+ * Queue a frame (see blink_submit_frame()) and return without waiting for
+ * the device. With coalesce set it goes to the mailbox. Otherwise, if
+ * queue_depth URBs are already in flight, wait for room (or fail with
+ * -EAGAIN for O_NONBLOCK files).
+ */
+static int blink_queue_frame(struct usb_blink *dev, const unsigned int *colors,
+			     const unsigned long *set, bool nonblock)
+{
+	unsigned int needed = blink_frame_reports(dev);
+	int retval;
+
+	if (READ_ONCE(coalesce))
+		return blink_post_frame(dev, colors, set);
+
+	for (;;) {
+		mutex_lock(&dev->io_mutex);
+
+		/* disconnect() was called */
+		if (dev->disconnected) {
+			retval = -ENODEV;
+			goto out;
+		}
+
+		if (blink_queue_has_room(dev, needed))
+			break;
+
+		mutex_unlock(&dev->io_mutex);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(dev->wq,
+				blink_queue_has_room(dev, needed) ||
+				READ_ONCE(dev->disconnected)))
+			return -ERESTARTSYS;
+	}
+
+	retval = blink_submit_frame(dev, colors, set, NULL);
+out:
+	mutex_unlock(&dev->io_mutex);
+	return retval;
+}
+
+/*
+ * Pick the multi-LED report used for whole frames: the smallest one that
+ * covers every LED and that the device accepts, checked by switching all
+ * the LEDs off with it. Older firmware stalls on unknown reports: those
+ * devices keep using one report per LED. Called at probe time and when
+ * nr_leds changes, with io_mutex held.
+ */
+static void blink_probe_multi_report(struct usb_blink *dev)
+{
+	unsigned char *msg;
+	size_t len;
+	int i;
+
+	dev->multi_report = -1;
+	if (!multi_led)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(blink_multi_reports); i++) {
+		if (blink_multi_reports[i].nr_leds < dev->nr_leds)
+			continue;
+
+		len = BLINK_MULTI_REPORT_SIZE(blink_multi_reports[i].nr_leds);
+		if (!(msg = kzalloc(len, GFP_KERNEL)))
+			return;
+		msg[0] = blink_multi_reports[i].id;
+
+		/* Synchronous, with a timeout, after any frame still queued */
+		if (usb_control_msg(dev->udev,
+				    usb_sndctrlpipe(dev->udev, 0), /* Endpoint #0 */
+				    USB_REQ_SET_CONFIGURATION,
+				    USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_DEVICE,
+				    msg[0], /* wValue */
+				    0,   /* wIndex=Endpoint # */
+				    msg, /* Pointer to the message */
+				    len, /* message's size in bytes */
+				    BLINK_PROBE_TIMEOUT_MS) >= 0) {
+			kfree(msg);
+			dev->multi_report = i;
+			memset(dev->colors, 0, sizeof(dev->colors));
+			/* Every LED is off now */
+			dev->colors_synced = atomic_read(&dev->colors_gen);
+			return;
+		}
+
+		dev_info(&dev->interface->dev,
+			 "Multi-LED report %u not supported\n", msg[0]);
+		kfree(msg);
+	}
+
+	dev_info(&dev->interface->dev, "Using one transfer per LED\n");
+}
+
+/*
+ * LEDs of the device, from the product variant. BlinkStick firmware puts
+ * the major version at the end of the serial number ("BS000000-3.0");
+ * version 3 devices tell their variant in bcdDevice.
+ */
+static unsigned int blink_detect_leds(struct usb_device *udev)
+{
+	const char *serial = udev->serial;
+	size_t len = serial ? strlen(serial) : 0;
+
+	if (len < 3)
+		return 8;
+
+	switch (serial[len - 3]) {
+	case '1':		/* BlinkStick */
+		return 1;
+	case '2':		/* BlinkStick Pro */
+		return 64;
+	case '3':
+		switch (le16_to_cpu(udev->descriptor.bcdDevice)) {
+		case 0x0200:	/* BlinkStick Square */
+		case 0x0201:	/* BlinkStick Strip */
+			return 8;
+		case 0x0202:	/* BlinkStick Nano */
+			return 2;
+		case 0x0203:	/* BlinkStick Flex */
+			return 32;
+		}
+	}
+	return 8;
+}
+
+/* /sys/bus/usb/devices/<interface>/nr_leds: LEDs driven by the device */
+static ssize_t nr_leds_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_blink *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->nr_leds));
+}
+
+static ssize_t nr_leds_store(struct device *d, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_blink *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int n;
+	int retval;
+
+	if ((retval = kstrtouint(buf, 0, &n)))
+		return retval;
+	if (n == 0 || n > BLINK_MAX_LEDS)
+		return -EINVAL;
+
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {
+		mutex_unlock(&dev->io_mutex);
+		return -ENODEV;
+	}
+	WRITE_ONCE(dev->nr_leds, n);
+	atomic_inc(&dev->colors_gen);
+	blink_probe_multi_report(dev);
+	mutex_unlock(&dev->io_mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(nr_leds);
+
+/*
+ * Frames replaced in the mailbox by a newer full frame before being sent
+ * (merged ones still reach the LEDs and are not counted), plus
+ * animation frames skipped because the URB queue was full
+ */
+static ssize_t frames_dropped_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_blink *dev = usb_get_intfdata(to_usb_interface(d));
+	u64 dropped;
+
+	spin_lock_irq(&dev->mbox_lock);
+	dropped = dev->frames_dropped;
+	spin_unlock_irq(&dev->mbox_lock);
+
+	return sysfs_emit(buf, "%llu\n", dropped);
+}
+static DEVICE_ATTR_RO(frames_dropped);
+
+#define BLINK_STAT_ATTR(_name, _field)						\
+static ssize_t _name##_show(struct device *d, struct device_attribute *attr,	\
+			    char *buf)						\
+{										\
+	struct usb_blink *dev = usb_get_intfdata(to_usb_interface(d));		\
+										\
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&dev->_field));		\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+BLINK_STAT_ATTR(frames_sent, frames_sent);
+BLINK_STAT_ATTR(transfers, transfers);
+BLINK_STAT_ATTR(bytes, bytes);
+BLINK_STAT_ATTR(errors, xfer_errors);
+
+/*
+ * USB round-trip latency: one "<upper bound in us> <count>" line per
+ * bucket, the last one ("inf") open-ended. A spread to the right points
+ * to the device or the bus; a flat histogram with many frames_dropped,
+ * to an application writing faster than the LEDs can follow.
+ */
+static ssize_t latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct usb_blink *dev = usb_get_intfdata(to_usb_interface(d));
+	int len = 0;
+	int i;
+
+	for (i = 0; i < BLINK_LAT_BUCKETS - 1; i++)
+		len += sysfs_emit_at(buf, len, "%7lu %lld\n",
+				     1UL << (BLINK_LAT_MIN_SHIFT + i),
+				     atomic64_read(&dev->latency[i]));
+	len += sysfs_emit_at(buf, len, "%7s %lld\n", "inf",
+			     atomic64_read(&dev->latency[i]));
+	return len;
+}
+static DEVICE_ATTR_RO(latency);
+
+static struct attribute *blink_attrs[] = {
+	&dev_attr_nr_leds.attr,
+	&dev_attr_frames_dropped.attr,
+	&dev_attr_frames_sent.attr,
+	&dev_attr_transfers.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_errors.attr,
+	&dev_attr_latency.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(blink);
+
+/*
+ * Frames of an animation are shown by a work item that an hrtimer queues
+ * when each frame is due. Deadlines are absolute (previous deadline plus
+ * the frame duration), so the time spent queueing a frame does not add
+ * up into drift. If the URB queue is full when a frame is due, that frame
+ * is skipped instead of delaying the rest of the animation.
+ */
+static enum hrtimer_restart blink_anim_timer(struct hrtimer *timer)
+{
+	struct usb_blink *dev = container_of(timer, struct usb_blink, anim_timer);
+
+	queue_work(system_highpri_wq, &dev->anim_work);
+	return HRTIMER_NORESTART;
+}
+
+static void blink_anim_work(struct work_struct *work)
+{
+	struct usb_blink *dev = container_of(work, struct usb_blink, anim_work);
+	struct blink_anim_data *anim;
+	unsigned int colors[BLINK_MAX_LEDS] = {0};
+	DECLARE_BITMAP(set, BLINK_MAX_LEDS);
+	unsigned int frame, n;
+
+	mutex_lock(&dev->anim_lock);
+
+	if (!dev->anim_running)
+		goto out;
+
+	/* Frame boundary: switch to an animation loaded while playing */
+	if (dev->anim_next) {
+		kvfree(dev->anim);
+		dev->anim = dev->anim_next;
+		dev->anim_next = NULL;
+		dev->anim_frame = 0;
+		dev->anim_loop = 0;
+	}
+
+	anim = dev->anim;
+	frame = dev->anim_frame;
+
+	/* nr_leds may have been lowered through sysfs after the load */
+	n = min(anim->nr_leds, READ_ONCE(dev->nr_leds));
+	memcpy(colors, &anim->colors[frame * anim->nr_leds], n * sizeof(u32));
+	bitmap_zero(set, BLINK_MAX_LEDS);
+	bitmap_set(set, 0, n);
+
+	switch (blink_queue_frame(dev, colors, set, true)) {
+	case -ENODEV:
+		dev->anim_running = false;
+		goto out;
+	case -EAGAIN:
+		/* URB queue full (coalesce=0): this frame is skipped */
+		spin_lock_irq(&dev->mbox_lock);
+		dev->frames_dropped++;
+		spin_unlock_irq(&dev->mbox_lock);
+		break;
+	}
+
+	dev->anim_deadline = ktime_add_ms(dev->anim_deadline, anim->durations[frame]);
+
+	if (++dev->anim_frame == anim->nr_frames) {
+		dev->anim_frame = 0;
+		if (anim->repeat && ++dev->anim_loop == anim->repeat) {
+			dev->anim_running = false;	/* Last frame stays on */
+			goto out;
+		}
+	}
+
+	hrtimer_start(&dev->anim_timer, dev->anim_deadline, HRTIMER_MODE_ABS);
+out:
+	mutex_unlock(&dev->anim_lock);
+}
+
+/* Copy in an animation from user space and check it */
+static struct blink_anim_data *blink_anim_copy(const struct blink_anim *ua)
+{
+	struct blink_anim_data *anim;
+	size_t nr_colors;
+	int i;
+
+	if (ua->nr_frames == 0 || ua->nr_frames > BLINK_ANIM_MAX_FRAMES ||
+	    ua->nr_leds == 0 || ua->nr_leds > BLINK_MAX_LEDS ||
+	    (ua->flags & ~BLINK_ANIM_START))
+		return ERR_PTR(-EINVAL);
+
+	nr_colors = (size_t)ua->nr_frames * ua->nr_leds;
+
+	/* One allocation: header, durations and colors */
+	anim = kvmalloc(sizeof(*anim) + (ua->nr_frames + nr_colors) * sizeof(u32),
+			GFP_KERNEL);
+	if (!anim)
+		return ERR_PTR(-ENOMEM);
+
+	anim->nr_frames = ua->nr_frames;
+	anim->nr_leds = ua->nr_leds;
+	anim->repeat = ua->repeat;
+	anim->durations = (u32 *)(anim + 1);
+	anim->colors = anim->durations + anim->nr_frames;
+
+	if (copy_from_user(anim->durations, u64_to_user_ptr(ua->durations),
+			   anim->nr_frames * sizeof(u32)) ||
+	    copy_from_user(anim->colors, u64_to_user_ptr(ua->colors),
+			   nr_colors * sizeof(u32))) {
+		kvfree(anim);
+		return ERR_PTR(-EFAULT);
+	}
+
+	for (i = 0; i < anim->nr_frames; i++) {
+		if (anim->durations[i] == 0) {
+			kvfree(anim);
+			return ERR_PTR(-EINVAL);
+		}
+	}
+
+	for (i = 0; i < nr_colors; i++)
+		anim->colors[i] &= 0xffffff;
+
+	return anim;
+}
+
+/* Play dev->anim from its first frame. Must hold anim_lock. */
+static void blink_anim_start_locked(struct usb_blink *dev)
+{
+	dev->anim_running = true;
+	dev->anim_frame = 0;
+	dev->anim_loop = 0;
+	dev->anim_deadline = ktime_get();
+	queue_work(system_highpri_wq, &dev->anim_work);
+}
+
+/* Stop the animation and wait until no frame is being queued */
+static void blink_anim_stop(struct usb_blink *dev)
+{
+	mutex_lock(&dev->anim_lock);
+	dev->anim_running = false;
+	mutex_unlock(&dev->anim_lock);
+
+	/* The work item checks anim_running before arming the timer again */
+	hrtimer_cancel(&dev->anim_timer);
+	cancel_work_sync(&dev->anim_work);
+}
+
+static long blink_anim_load(struct usb_blink *dev, struct blink_anim __user *arg)
+{
+	struct blink_anim ua;
+	struct blink_anim_data *anim;
+
+	if (copy_from_user(&ua, arg, sizeof(ua)))
+		return -EFAULT;
 
+	anim = blink_anim_copy(&ua);
+	if (IS_ERR(anim))
+		return PTR_ERR(anim);
+
+	mutex_lock(&dev->anim_lock);
+	if (dev->anim_running) {
+		/* Picked up by blink_anim_work() at the next frame boundary */
+		kvfree(dev->anim_next);
+		dev->anim_next = anim;
+	} else {
+		kvfree(dev->anim_next);
+		dev->anim_next = NULL;
+		kvfree(dev->anim);
+		dev->anim = anim;
+		if (ua.flags & BLINK_ANIM_START)
+			blink_anim_start_locked(dev);
+	}
+	mutex_unlock(&dev->anim_lock);
+
+	return 0;
+}
 
 #define NR_SAMPLE_COLORS 4
 
 unsigned int sample_colors[]={0x000011, 0x110000, 0x001100, 0x000000};
-static ssize_t blink_write(struct file *file, const char *user_buffer,
-              size_t len, loff_t *off)
+
+/*
+ * Parse a frame in text form, "led:0xRRGGBB" pairs separated by commas,
+ * into colors[] and the set of LEDs given. The text is modified. Tokens
+ * that are not a pair are skipped, unless 'strict' is set: then they fail
+ * with -EINVAL (empty ones are still allowed).
+ */
+static int blink_parse_frame(char *kbuf, unsigned int max_leds,
+                             unsigned int *colors, unsigned long *led_set,
+                             bool strict)
 {
-    struct usb_blink *dev = file->private_data;
-    int retval = 0;
-    int i;
-    unsigned char *messages;
-    char *kbuf;
     char *token;
     unsigned int led_number, color;
-    bool led_set[NR_LEDS] = {false}; // Arreglo de banderas para LED configurado
-    
-    // Allocate memory for messages (64 bytes * NR_LEDS)
-    messages = kmalloc(NR_BYTES_BLINK_MSG * NR_LEDS, GFP_KERNEL);
-    if (!messages) {
-        return -ENOMEM; // Manejo de errores al asignar memoria
-    }
-    
-    // Copiar la cadena de user_buffer a un buffer auxiliar (kbuf)
-    kbuf = kmalloc(len + 1, GFP_KERNEL);
-    if (!kbuf) {
-        kfree(messages);
-        return -ENOMEM; // Manejo de errores al asignar memoria
-    }
-    
-    if (copy_from_user(kbuf, user_buffer, len)) {
-        kfree(messages);
-        kfree(kbuf);
-        return -EFAULT; // Error de copia desde el usuario
-    }
-    kbuf[len] = '\0'; // Asegurarse de que kbuf esté terminado en NULL
+    int end;
+
+    bitmap_zero(led_set, BLINK_MAX_LEDS);
 
-    // Inicializar los mensajes
-    memset(messages, 0, NR_BYTES_BLINK_MSG * NR_LEDS);
-    
     // Partir en tokens separados con ',' usando strsep()
     token = strsep(&kbuf, ",");
     while (token != NULL) {
         // Analizar el contenido de cada par (ledn,color)
-        if (sscanf(token, "%u:0x%6x", &led_number, &color) == 2) {
+        if (sscanf(token, "%u:0x%6x%n", &led_number, &color, &end) == 2) {
+            if (strict && *skip_spaces(token + end) != '\0')
+                return -EINVAL; // Sobran caracteres tras el color
+
             // Verificación de que el número de LED esté dentro del rango permitido
-            if (led_number >= NR_LEDS) {
-                kfree(messages);
-                kfree(kbuf);
+            if (led_number >= max_leds)
                 return -EINVAL; // Argumento inválido, número de LED fuera de rango
-            }
-
-            // Marcar el LED como configurado
-            led_set[led_number] = true;
-
-            // Rellenar el mensaje correspondiente para el LED en cuestión
-            messages[led_number * NR_BYTES_BLINK_MSG] = '\x05'; // Command
-            messages[led_number * NR_BYTES_BLINK_MSG + 1] = 0x00; // Reserved
-            messages[led_number * NR_BYTES_BLINK_MSG + 2] = led_number; // LED number
-            messages[led_number * NR_BYTES_BLINK_MSG + 3] = (color >> 16) & 0xff; // R
-            messages[led_number * NR_BYTES_BLINK_MSG + 4] = (color >> 8) & 0xff;  // G
-            messages[led_number * NR_BYTES_BLINK_MSG + 5] = color & 0xff;         // B
+
+            colors[led_number] = color;
+            __set_bit(led_number, led_set); // Marcar el LED como configurado
+        } else if (strict && *skip_spaces(token) != '\0') {
+            return -EINVAL; // Token mal formado
         }
         // Obtener el siguiente token
         token = strsep(&kbuf, ",");
     }
+    return 0;
+}
 
-    // Asegurarse de que los LEDs no configurados estén apagados
-    for (i = 0; i < NR_LEDS; i++) {
-        if (!led_set[i]) {
-            // Configuración para apagar el LED si no fue especificado
-            messages[i * NR_BYTES_BLINK_MSG] = '\x05'; // Command
-            messages[i * NR_BYTES_BLINK_MSG + 1] = 0x00; // Reserved
-            messages[i * NR_BYTES_BLINK_MSG + 2] = i; // LED number
-            messages[i * NR_BYTES_BLINK_MSG + 3] = 0x00; // R apagado
-            messages[i * NR_BYTES_BLINK_MSG + 4] = 0x00; // G apagado
-            messages[i * NR_BYTES_BLINK_MSG + 5] = 0x00; // B apagado
-        }
+static ssize_t blink_write(struct file *file, const char *user_buffer,
+              size_t len, loff_t *off)
+{
+    struct usb_blink *dev = file->private_data;
+    int retval = 0;
+    char *kbuf;
+    unsigned int colors[BLINK_MAX_LEDS] = {0}; // Los LEDs no configurados quedan apagados...
+    DECLARE_BITMAP(led_set, BLINK_MAX_LEDS);   // ...o, en modo merge, con su color actual
+
+    // Si fallo alguna transferencia anterior, se notifica ahora
+    if ((retval = blink_take_error(dev)))
+        return retval;
+
+    // Copiar la cadena de user_buffer a un buffer auxiliar (kbuf)
+    kbuf = kmalloc(len + 1, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM; // Manejo de errores al asignar memoria
+
+    if (copy_from_user(kbuf, user_buffer, len)) {
+        kfree(kbuf);
+        return -EFAULT; // Error de copia desde el usuario
     }
+    kbuf[len] = '\0'; // Asegurarse de que kbuf esté terminado en NULL
+
+    retval = blink_parse_frame(kbuf, READ_ONCE(dev->nr_leds), colors, led_set, false);
+    kfree(kbuf);
+    if (retval)
+        return retval;
 
-    // Enviar los mensajes a través de usb_control_msg()
-    for (i = 0; i < NR_LEDS; i++) {
-        retval = usb_control_msg(dev->udev,
-                                  usb_sndctrlpipe(dev->udev, 0), /* Endpoint #0 */
-                                  USB_REQ_SET_CONFIGURATION,
-                                  USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_DEVICE,
-                                  0x5, /* wValue */
-                                  0,   /* wIndex=Endpoint # */
-                                  &messages[i * NR_BYTES_BLINK_MSG], /* Pointer to the message */
-                                  NR_BYTES_BLINK_MSG, /* message's size in bytes */
-                                  0);
-
-        if (retval < 0) {
+    // Encolar solo los LEDs que cambian; write() no espera a que lleguen al dispositivo
+    retval = blink_queue_frame(dev, colors, READ_ONCE(merge) ? led_set : NULL,
+                               file->f_flags & O_NONBLOCK);
+    if (retval < 0) {
+        if (retval != -EAGAIN && retval != -ERESTARTSYS)
             printk(KERN_ALERT "Executed with retval=%d\n", retval);
-            goto out_error;
-        }
+        return retval;
     }
 
-    // Liberar el buffer auxiliar
-    kfree(kbuf);
-    kfree(messages);
     (*off) += len;
     return len;
+}
+
+
+/*
+ * Called when a user program invokes read(): returns the colors last sent
+ * to the LEDs, in the same format write() takes, so "cat" shows the
+ * current frame
+ */
+static ssize_t blink_read(struct file *file, char __user *user_buffer,
+                          size_t len, loff_t *off)
+{
+    struct usb_blink *dev = file->private_data;
+    char *kbuf;
+    int n = 0;
+    int i;
+    ssize_t retval;
+
+    // "63:0xRRGGBB," son como mucho 12 caracteres por LED
+    kbuf = kmalloc(BLINK_MAX_LEDS * 12 + 2, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
 
-out_error:
+    mutex_lock(&dev->io_mutex);
+    for (i = 0; i < dev->nr_leds; i++)
+        n += sprintf(kbuf + n, "%s%u:0x%06X", i ? "," : "", i, dev->colors[i]);
+    mutex_unlock(&dev->io_mutex);
+    n += sprintf(kbuf + n, "\n");
+
+    retval = simple_read_from_buffer(user_buffer, len, off, kbuf, n);
     kfree(kbuf);
-    kfree(messages);
     return retval;
 }
 
+/*
+ * fsync() waits until every frame queued so far has been sent (or
+ * replaced by a newer one in the mailbox) and reports a transfer error,
+ * if any
+ */
+static int blink_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct usb_blink *dev = file->private_data;
+
+	long retval;
+
+	retval = wait_event_interruptible_timeout(dev->wq,
+			blink_idle(dev) || READ_ONCE(dev->disconnected),
+			msecs_to_jiffies(BLINK_FSYNC_TIMEOUT_MS));
+	if (retval < 0)
+		return retval;
+	if (retval == 0)
+		return -ETIMEDOUT;
+
+	return blink_take_error(dev);
+}
+
+/* Unpack R, G, B bytes into 0xRRGGBB colors */
+static void blink_rgb_to_colors(const u8 *rgb, unsigned int nr_leds, unsigned int *colors)
+{
+	int i;
+
+	for (i = 0; i < nr_leds; i++)
+		colors[i] = (rgb[3 * i] << 16) | (rgb[3 * i + 1] << 8) | rgb[3 * i + 2];
+}
+
+static long blink_set_frame(struct usb_blink *dev, struct blink_frame __user *arg,
+			    bool nonblock)
+{
+	struct blink_frame uf;
+	u8 rgb[3 * BLINK_MAX_LEDS];
+	unsigned int colors[BLINK_MAX_LEDS] = {0};
+	DECLARE_BITMAP(set, BLINK_MAX_LEDS);
+	long retval;
+
+	if (copy_from_user(&uf, arg, sizeof(uf)))
+		return -EFAULT;
+
+	if (uf.nr_leds > READ_ONCE(dev->nr_leds) || (uf.flags & ~BLINK_FRAME_MERGE))
+		return -EINVAL;
+
+	if (copy_from_user(rgb, u64_to_user_ptr(uf.rgb), 3 * uf.nr_leds))
+		return -EFAULT;
+
+	if ((retval = blink_take_error(dev)))
+		return retval;
+
+	blink_rgb_to_colors(rgb, uf.nr_leds, colors);
+	bitmap_zero(set, BLINK_MAX_LEDS);
+	bitmap_set(set, 0, uf.nr_leds);
+
+	return blink_queue_frame(dev, colors,
+				 (uf.flags & BLINK_FRAME_MERGE) ? set : NULL, nonblock);
+}
+
+/* Send the frame in the framebuffer, as user space left it */
+static long blink_commit(struct usb_blink *dev, bool nonblock)
+{
+	unsigned int colors[BLINK_MAX_LEDS] = {0};
+	long retval;
+
+	if ((retval = blink_take_error(dev)))
+		return retval;
+
+	blink_rgb_to_colors(dev->fb, READ_ONCE(dev->nr_leds), colors);
+	return blink_queue_frame(dev, colors, NULL, nonblock);
+}
+
+/*
+ * Map the framebuffer of the device. The page stays valid after a
+ * disconnect; commits then fail with -ENODEV.
+ */
+static int blink_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usb_blink *dev = file->private_data;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->fb));
+}
+
+/* ioctl() interface, see blinkdrv.h */
+static long blink_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct usb_blink *dev = file->private_data;
+	long retval = 0;
+
+	if (READ_ONCE(dev->disconnected))
+		return -ENODEV;
+
+	switch (cmd) {
+	case BLINK_IOC_ANIM_LOAD:
+		return blink_anim_load(dev, (struct blink_anim __user *)arg);
+	case BLINK_IOC_ANIM_START:
+		blink_anim_stop(dev);
+		mutex_lock(&dev->anim_lock);
+		if (dev->anim_next) {
+			kvfree(dev->anim);
+			dev->anim = dev->anim_next;
+			dev->anim_next = NULL;
+		}
+		if (dev->anim)
+			blink_anim_start_locked(dev);
+		else
+			retval = -EINVAL;	/* Nothing loaded */
+		mutex_unlock(&dev->anim_lock);
+		return retval;
+	case BLINK_IOC_ANIM_STOP:
+		blink_anim_stop(dev);
+		return 0;
+	case BLINK_IOC_SET_FRAME:
+		return blink_set_frame(dev, (struct blink_frame __user *)arg,
+				       file->f_flags & O_NONBLOCK);
+	case BLINK_IOC_COMMIT:
+		return blink_commit(dev, file->f_flags & O_NONBLOCK);
+	default:
+		return -ENOTTY;
+	}
+}
 
 /*
  * Operations associated with the character device 
@@ -222,7 +1245,12 @@ out_error:
  */
 static const struct file_operations blink_fops = {
 	.owner =	THIS_MODULE,
+	.read =		blink_read,		/* read() returns the current frame */
 	.write =	blink_write,	 	/* write() operation on the file */
+	.fsync =	blink_fsync,		/* fsync() waits for queued frames */
+	.unlocked_ioctl = blink_ioctl,		/* animations and binary frames, see blinkdrv.h */
+	.compat_ioctl =	compat_ptr_ioctl,
+	.mmap =		blink_mmap,		/* framebuffer for BLINK_IOC_COMMIT */
 	.open =		blink_open,			/* open() operation on the file */
 	.release =	blink_release, 		/* close() operation on the file */
 };
@@ -262,6 +1290,7 @@ static int blink_probe(struct usb_interface *interface,
 {
 	struct usb_blink *dev;
 	int retval = -ENOMEM;
+	int i;
 
 	/*
  	 * Allocate memory for a usb_blink structure.
@@ -280,6 +1309,48 @@ static int blink_probe(struct usb_interface *interface,
 	kref_init(&dev->kref);
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
+	init_usb_anchor(&dev->submitted);
+	atomic_set(&dev->in_flight, 0);
+	init_waitqueue_head(&dev->wq);
+	spin_lock_init(&dev->err_lock);
+	dev->errors = 0;
+	mutex_init(&dev->io_mutex);
+	dev->disconnected = false;
+	dev->nr_leds = nr_leds ? min(nr_leds, (unsigned int)BLINK_MAX_LEDS)
+			       : blink_detect_leds(dev->udev);
+	memset(dev->colors, 0, sizeof(dev->colors));
+	atomic_set(&dev->colors_gen, 0);
+	dev->colors_synced = -1;	/* Unknown until the first frame */
+	spin_lock_init(&dev->mbox_lock);
+	dev->mbox_full = false;
+	dev->mbox_merge = false;
+	INIT_WORK(&dev->mbox_work, blink_mbox_work);
+	dev->frames_dropped = 0;
+	atomic64_set(&dev->frames_sent, 0);
+	atomic64_set(&dev->transfers, 0);
+	atomic64_set(&dev->bytes, 0);
+	atomic64_set(&dev->xfer_errors, 0);
+	for (i = 0; i < BLINK_LAT_BUCKETS; i++)
+		atomic64_set(&dev->latency[i], 0);
+	mutex_init(&dev->anim_lock);
+	dev->anim = NULL;
+	dev->anim_next = NULL;
+	dev->anim_running = false;
+	hrtimer_init(&dev->anim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	dev->anim_timer.function = blink_anim_timer;
+	INIT_WORK(&dev->anim_work, blink_anim_work);
+
+	/* A whole page: it is mapped into user space as is */
+	BUILD_BUG_ON(BLINK_FB_SIZE > PAGE_SIZE);
+	dev->fb = (u8 *)get_zeroed_page(GFP_KERNEL);
+	if (!dev->fb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	mutex_lock(&dev->io_mutex);
+	blink_probe_multi_report(dev);
+	mutex_unlock(&dev->io_mutex);
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
@@ -294,10 +1365,14 @@ static int blink_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	mutex_lock(&blink_devices_lock);
+	list_add_tail(&dev->node, &blink_devices);
+	mutex_unlock(&blink_devices_lock);
+
 	/* let the user know what node this device is now attached to */	
 	dev_info(&interface->dev,
-		 "Blinkstick device now attached to blinkstick-%d",
-		 interface->minor);
+		 "Blinkstick device now attached to blinkstick-%d (%u LEDs)",
+		 interface->minor, dev->nr_leds);
 	return 0;
 
 error:
@@ -319,11 +1394,27 @@ static void blink_disconnect(struct usb_interface *interface)
 	dev = usb_get_intfdata(interface);
 	usb_set_intfdata(interface, NULL);
 
+	/* no more broadcasts to this device */
+	mutex_lock(&blink_devices_lock);
+	list_del(&dev->node);
+	mutex_unlock(&blink_devices_lock);
+
 	/* give back our minor */
 	usb_deregister_dev(interface, &blink_class);
 
+	/* no more frames from the animation engine */
+	blink_anim_stop(dev);
+
 	/* prevent more I/O from starting */
+	mutex_lock(&dev->io_mutex);
+	dev->disconnected = true;
 	dev->interface = NULL;
+	mutex_unlock(&dev->io_mutex);
+
+	/* cancel the frames still queued and wake up writers waiting for room */
+	cancel_work_sync(&dev->mbox_work);
+	usb_kill_anchored_urbs(&dev->submitted);
+	wake_up_interruptible(&dev->wq);
 
 	/* decrement our usage count */
 	kref_put(&dev->kref, blink_delete);
@@ -347,18 +1438,173 @@ static struct usb_driver blink_driver = {
 	.probe =	blink_probe,
 	.disconnect =	blink_disconnect,
 	.id_table =	blink_table,
+	.dev_groups =	blink_groups,	/* sysfs attributes of the interface */
+};
+
+/*
+ * Broadcast node, /dev/usb/blinkstick_all. Each line written is a frame
+ * in the same text form as for /dev/usb/blinkstickN. A line starting with
+ * "@N " only applies to blinkstickN; the others apply to every device
+ * without a line of its own. LEDs beyond the length of a device's strip
+ * are ignored.
+ *
+ * Unlike writes to one device, a malformed pair fails the whole write with
+ * -EINVAL, and nothing is sent.
+ *
+ * The transfers for all devices are submitted at once, bypassing the
+ * mailboxes, and write() returns when all of them have completed (or
+ * after BLINK_FSYNC_TIMEOUT_MS), so the devices change together.
+ */
+#define BLINK_ALL_MAX_LINES 128
+
+struct blink_all_line {
+	int		minor;		/* -1: every device */
+	unsigned int	colors[BLINK_MAX_LEDS];
+	DECLARE_BITMAP(set, BLINK_MAX_LEDS);
+};
+
+static ssize_t blink_all_write(struct file *file, const char __user *user_buffer,
+			       size_t len, loff_t *off)
+{
+	struct blink_all_line *lines;
+	struct blink_all_line *line;
+	struct blink_sync *sync;
+	struct usb_blink *dev;
+	char *kbuf, *cur, *text;
+	int max_lines = 1;
+	int nr_lines = 0;
+	int retval = 0;
+	long left;
+	int i;
+
+	if (len > PAGE_SIZE)
+		return -EINVAL;
+
+	kbuf = memdup_user_nul(user_buffer, len);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+
+	/* One entry per line in the buffer, not BLINK_ALL_MAX_LINES every time */
+	for (cur = kbuf; (cur = strchr(cur, '\n')) && max_lines < BLINK_ALL_MAX_LINES; cur++)
+		max_lines++;
+
+	lines = kvcalloc(max_lines, sizeof(*lines), GFP_KERNEL);
+	sync = kzalloc(sizeof(*sync), GFP_KERNEL);
+	if (!lines || !sync) {
+		retval = -ENOMEM;
+		goto out_free;
+	}
+
+	/* Parse every line first: a bad one sends nothing */
+	cur = kbuf;
+	while ((text = strsep(&cur, "\n")) != NULL) {
+		text = skip_spaces(text);
+		if (*text == '\0')
+			continue;
+		if (nr_lines == max_lines) {
+			retval = -E2BIG;
+			goto out_free;
+		}
+		line = &lines[nr_lines++];
+		line->minor = -1;
+		if (*text == '@') {
+			if (sscanf(text + 1, "%d", &line->minor) != 1 || line->minor < 0) {
+				retval = -EINVAL;
+				goto out_free;
+			}
+			text = strpbrk(text, " \t") ? : "";
+		}
+		if ((retval = blink_parse_frame(text, BLINK_MAX_LEDS,
+						line->colors, line->set, true)))
+			goto out_free;
+	}
+
+	atomic_set(&sync->pending, 1);	/* Dropped once everything is submitted */
+	atomic_set(&sync->refs, 1);	/* Ours */
+	init_completion(&sync->done);
+
+	mutex_lock(&blink_devices_lock);
+	list_for_each_entry(dev, &blink_devices, node) {
+		line = NULL;
+		/* The last line for this device, or else the last one for all */
+		for (i = 0; i < nr_lines; i++) {
+			if (lines[i].minor == dev->interface->minor)
+				line = &lines[i];
+			else if (lines[i].minor == -1 && (!line || line->minor == -1))
+				line = &lines[i];
+		}
+		if (!line)
+			continue;
+
+		mutex_lock(&dev->io_mutex);
+		if (!dev->disconnected)
+			retval = blink_submit_frame(dev, line->colors,
+						    READ_ONCE(merge) ? line->set : NULL, sync);
+		mutex_unlock(&dev->io_mutex);
+		if (retval)
+			break;
+	}
+	mutex_unlock(&blink_devices_lock);
+
+	if (atomic_dec_and_test(&sync->pending))
+		complete(&sync->done);
+
+	left = wait_for_completion_interruptible_timeout(&sync->done,
+			msecs_to_jiffies(BLINK_FSYNC_TIMEOUT_MS));
+	if (!retval) {
+		if (left < 0)
+			retval = left;
+		else if (left == 0)
+			retval = -ETIMEDOUT;
+		else if (sync->error)
+			retval = sync->error == -EPIPE ? -EPIPE : -EIO;
+	}
+
+	blink_sync_put(sync);
+	sync = NULL;
+out_free:
+	kfree(sync);
+	kvfree(lines);
+	kfree(kbuf);
+	if (retval)
+		return retval;
+
+	(*off) += len;
+	return len;
+}
+
+static const struct file_operations blink_all_fops = {
+	.owner =	THIS_MODULE,
+	.write =	blink_all_write,
+};
+
+static struct miscdevice blink_all_dev = {
+	.minor =	MISC_DYNAMIC_MINOR,
+	.name =		"blinkstick_all",
+	.nodename =	"usb/blinkstick_all",
+	.mode =		0666,
+	.fops =		&blink_all_fops,
 };
 
 /* Module initialization */
 int blinkdrv_module_init(void)
 {
-   return usb_register(&blink_driver);
+   int retval;
+
+   if ((retval = misc_register(&blink_all_dev)))
+      return retval;
+
+   if ((retval = usb_register(&blink_driver)))
+      misc_deregister(&blink_all_dev);
+
+   return retval;
 }
 
 /* Module cleanup function */
 void blinkdrv_module_cleanup(void)
 {
   usb_deregister(&blink_driver);
+  misc_deregister(&blink_all_dev);
 }
 
 module_init(blinkdrv_module_init);
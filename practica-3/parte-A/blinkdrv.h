@@ -0,0 +1,72 @@
+/*
+ * ioctl interface of the blinkstick driver, shared by the kernel module
+ * and user programs.
+ */
+#ifndef BLINKDRV_H
+#define BLINKDRV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Most LEDs a device may have (BlinkStick Pro); see the nr_leds attribute */
+#define BLINK_MAX_LEDS 64
+
+/* Longest animation accepted by BLINK_IOC_ANIM_LOAD */
+#define BLINK_ANIM_MAX_FRAMES 4096
+
+/* Start playing the animation as soon as it is loaded */
+#define BLINK_ANIM_START 0x1
+
+/*
+ * Animation played by the driver: frame i shows colors[i * nr_leds ...]
+ * (0xRRGGBB, one per LED starting at LED 0) for durations[i] milliseconds.
+ * LEDs beyond nr_leds keep their color.
+ */
+struct blink_anim {
+	__u32 nr_frames;
+	__u32 nr_leds;		/* Colors given per frame */
+	__u32 repeat;		/* Times the whole list is played, 0 = forever */
+	__u32 flags;		/* BLINK_ANIM_* */
+	__u64 durations;	/* User pointer to __u32[nr_frames] */
+	__u64 colors;		/* User pointer to __u32[nr_frames * nr_leds] */
+};
+
+/* LEDs beyond nr_leds keep their color (default: they are switched off) */
+#define BLINK_FRAME_MERGE 0x1
+
+/* A frame packed as 3 bytes (R, G, B) per LED, starting at LED 0 */
+struct blink_frame {
+	__u64 rgb;		/* User pointer to __u8[3 * nr_leds] */
+	__u32 nr_leds;
+	__u32 flags;		/* BLINK_FRAME_* */
+};
+
+/*
+ * Size of the framebuffer that mmap() (offset 0, MAP_SHARED) gives
+ * access to. It holds the frame in the same packed R, G, B layout, and
+ * BLINK_IOC_COMMIT sends it to the LEDs. All the files open on a device
+ * share its framebuffer.
+ */
+#define BLINK_FB_SIZE 4096
+
+#define BLINK_IOC_MAGIC 'b'
+
+/*
+ * Load an animation. If one is already playing, the new one replaces it
+ * at the next frame boundary and starts from its first frame.
+ */
+#define BLINK_IOC_ANIM_LOAD _IOW(BLINK_IOC_MAGIC, 1, struct blink_anim)
+
+/* Play the loaded animation from its first frame */
+#define BLINK_IOC_ANIM_START _IO(BLINK_IOC_MAGIC, 2)
+
+/* Stop playing; the LEDs keep the last frame shown */
+#define BLINK_IOC_ANIM_STOP _IO(BLINK_IOC_MAGIC, 3)
+
+/* Send a packed frame, without any text parsing */
+#define BLINK_IOC_SET_FRAME _IOW(BLINK_IOC_MAGIC, 4, struct blink_frame)
+
+/* Send the frame currently in the mmap()'ed framebuffer */
+#define BLINK_IOC_COMMIT _IO(BLINK_IOC_MAGIC, 5)
+
+#endif /* BLINKDRV_H */
@@ -4,6 +4,15 @@
 #include <linux/uaccess.h>  /* for copy_to_user */
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,1)
 #define __cconst__ const
@@ -22,37 +31,79 @@ int init_module(void);
 void cleanup_module(void);
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
+static loff_t device_llseek(struct file *, loff_t, int);
 
 #define SUCCESS 0
 #define DEVICE_NAME "chardev"   /* Dev name as it appears in /proc/devices   */
 #define CLASS_NAME "cool"
-#define BUF_LEN 80      /* Max length of the message from the device */
 
-#define DEVICE_COUNT 3
+/*
+ * Minors reserved for the driver. Instances can be created and removed
+ * at runtime anywhere in this range through /sys/class/cool/{create,remove}
+ */
+static unsigned int max_devices = 4096;
+module_param(max_devices, uint, 0444);
+MODULE_PARM_DESC(max_devices, "Number of minors reserved for chardev devices");
+
+/* Instances created when the module is loaded (minors 0..nr_devices-1) */
+static unsigned int nr_devices = 3;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of chardev devices created at load time");
+
+/* Capacity of the byte store of every new instance */
+static unsigned int capacity = 64 * 1024;
+module_param(capacity, uint, 0644);
+MODULE_PARM_DESC(capacity, "Bytes stored by each chardev device created from now on");
+
 /*
  * Global variables are declared as static, so are global within the file.
  */
 
 static dev_t start;
-static struct cdev* chardev = NULL;
 static struct class* class = NULL;
 
+/*
+ * Read latency histogram: bucket i counts reads that took less than
+ * 1us << i (the last one, everything slower)
+ */
+#define NR_LAT_BUCKETS 16
+
+/* I/O counters of a device, one copy per CPU so updates never bounce */
+struct chardev_stats {
+    u64 opens;
+    u64 reads;
+    u64 writes;
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 read_lat[NR_LAT_BUCKETS];
+};
+
 struct device_data {
-    int Device_Open; /* Is device open?  Used to prevent multiple access to device */
-    char msg[BUF_LEN];   /* The msg the device will give when asked */
-    char *msg_Ptr;       /* This will be initialized every time the
-                            device is opened successfully */
-    int counter;       /* Tracks the number of times the character
-                             device has been opened */
-    struct device* device;
-    dev_t major_minor;
+    atomic_t Device_Open; /* Files currently open on the device (any number) */
+    struct rw_semaphore lock; /* Readers share it, writers take it alone */
+    char *data;          /* Byte store of the device */
+    size_t capacity;     /* Bytes allocated in data */
+    size_t size;         /* Bytes written so far (end of file) */
+    struct chardev_stats __percpu *stats; /* Shown in /sys/class/cool/chardevN */
+    struct cdev cdev;      /* Own cdev, open() gets back here with container_of */
+    struct device device;  /* Keeps the structure alive while files are open */
+    unsigned int minor;
 };
 
+/*
+ * Live instances indexed by minor, protected by devices_lock. Only create
+ * and remove use it: open reaches its instance through the inode's cdev.
+ */
+static struct device_data **devices = NULL;
+static DEFINE_MUTEX(devices_lock);
+
 static struct file_operations fops = {
-    .read = device_read,
-    .write = device_write,
+    .owner = THIS_MODULE,
+    .llseek = device_llseek,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .release = device_release
 };
@@ -76,36 +127,253 @@ static char *cool_devnode(__cconst__ struct device *dev, umode_t *mode)
     return NULL;
 }
 
+/*
+ * Called when the last reference to the device goes away: after it has
+ * been removed and every file that had it open has been closed.
+ */
+static void device_data_release(struct device *dev)
+{
+    struct device_data* ddata = container_of(dev, struct device_data, device);
+
+    free_percpu(ddata->stats);
+    kvfree(ddata->data);
+    kfree(ddata);
+}
+
+/* Add up the per-CPU counters of a device */
+static void chardev_stats_sum(struct device_data* ddata, struct chardev_stats *sum)
+{
+    struct chardev_stats *st;
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(ddata->stats, cpu);
+        sum->opens += st->opens;
+        sum->reads += st->reads;
+        sum->writes += st->writes;
+        sum->bytes_read += st->bytes_read;
+        sum->bytes_written += st->bytes_written;
+        for (i = 0; i < NR_LAT_BUCKETS; i++)
+            sum->read_lat[i] += st->read_lat[i];
+    }
+}
+
+/* One read-only sysfs file per counter: /sys/class/cool/chardevN/<name> */
+#define CHARDEV_STAT_ATTR(_name)                                            \
+static ssize_t _name##_show(struct device *dev,                            \
+                            struct device_attribute *attr, char *buf)      \
+{                                                                           \
+    struct chardev_stats sum;                                               \
+                                                                            \
+    chardev_stats_sum(dev_get_drvdata(dev), &sum);                          \
+    return sysfs_emit(buf, "%llu\n", sum._name);                           \
+}                                                                           \
+static DEVICE_ATTR_RO(_name)
+
+CHARDEV_STAT_ATTR(opens);
+CHARDEV_STAT_ATTR(reads);
+CHARDEV_STAT_ATTR(writes);
+CHARDEV_STAT_ATTR(bytes_read);
+CHARDEV_STAT_ATTR(bytes_written);
+
+/*
+ * Read latency histogram, one line per bucket: upper bound in
+ * microseconds ("inf" for the last one) and number of reads
+ */
+static ssize_t read_latency_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+    struct chardev_stats sum;
+    int len = 0;
+    int i;
+
+    chardev_stats_sum(dev_get_drvdata(dev), &sum);
+
+    for (i = 0; i < NR_LAT_BUCKETS - 1; i++)
+        len += sysfs_emit_at(buf, len, "%8lu %llu\n", 1UL << i, sum.read_lat[i]);
+    len += sysfs_emit_at(buf, len, "%8s %llu\n", "inf", sum.read_lat[i]);
+
+    return len;
+}
+static DEVICE_ATTR_RO(read_latency);
+
+static struct attribute *chardev_attrs[] = {
+    &dev_attr_opens.attr,
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_bytes_read.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_read_latency.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(chardev);
+
+/*
+ * Create the instance with the given minor, or with the first free one if
+ * minor is negative. Returns the minor used. Must hold devices_lock.
+ */
+static int chardev_create(int minor)
+{
+    struct device_data* ddata;
+    int ret;
+
+    if (minor < 0) {
+        for (minor = 0; minor < max_devices && devices[minor]; minor++)
+            ;
+        if (minor == max_devices)
+            return -ENOSPC;
+    } else if (minor >= max_devices) {
+        return -EINVAL;
+    } else if (devices[minor]) {
+        return -EEXIST;
+    }
+
+    /* Allocate device state structure and zero fill it */
+    if ((ddata = kzalloc(sizeof(struct device_data), GFP_KERNEL)) == NULL)
+        return -ENOMEM;
+
+    ddata->minor = minor;
+    init_rwsem(&ddata->lock);
+    ddata->capacity = READ_ONCE(capacity);
+
+    if ((ddata->data = kvzalloc(ddata->capacity, GFP_KERNEL)) == NULL) {
+        kfree(ddata);
+        return -ENOMEM;
+    }
+
+    if ((ddata->stats = alloc_percpu(struct chardev_stats)) == NULL) {
+        kvfree(ddata->data);
+        kfree(ddata);
+        return -ENOMEM;
+    }
+
+    cdev_init(&ddata->cdev, &fops);
+    ddata->cdev.owner = THIS_MODULE;
+
+    /* A partir de aqui la memoria se libera con put_device() */
+    device_initialize(&ddata->device);
+    ddata->device.devt = MKDEV(MAJOR(start), minor);
+    ddata->device.class = class;
+    ddata->device.release = device_data_release;
+    ddata->device.groups = chardev_groups;  /* Created along with the device */
+    dev_set_drvdata(&ddata->device, ddata);
+
+    if ((ret = dev_set_name(&ddata->device, "%s%d", DEVICE_NAME, minor)))
+        goto error;
+
+    /* Registers the cdev with the device as parent, then the device itself */
+    if ((ret = cdev_device_add(&ddata->cdev, &ddata->device))) {
+        pr_err("cdev_device_add() %d failed\n", minor);
+        goto error;
+    }
+
+    devices[minor] = ddata;
+    return minor;
+
+error:
+    put_device(&ddata->device);
+    return ret;
+}
+
+/*
+ * Remove an instance. Files already open keep working on it until they are
+ * closed; new opens fail. Must hold devices_lock.
+ */
+static void chardev_remove(struct device_data* ddata)
+{
+    devices[ddata->minor] = NULL;
+    cdev_device_del(&ddata->cdev, &ddata->device);
+    put_device(&ddata->device);
+}
+
+/*
+ * echo N > /sys/class/cool/create crea /dev/chardevN, con N negativo
+ * se usa el primer minor libre
+ */
+static ssize_t create_store(struct class *cls, struct class_attribute *attr,
+                            const char *buf, size_t count)
+{
+    int minor, ret;
+
+    if ((ret = kstrtoint(buf, 0, &minor)))
+        return ret;
+
+    mutex_lock(&devices_lock);
+    ret = chardev_create(minor);
+    mutex_unlock(&devices_lock);
+
+    if (ret < 0)
+        return ret;
+
+    printk(KERN_INFO "Creado /dev/%s%d\n", DEVICE_NAME, ret);
+    return count;
+}
+static CLASS_ATTR_WO(create);
+
+/* echo N > /sys/class/cool/remove elimina /dev/chardevN */
+static ssize_t remove_store(struct class *cls, struct class_attribute *attr,
+                            const char *buf, size_t count)
+{
+    unsigned int minor;
+    int ret;
+
+    if ((ret = kstrtouint(buf, 0, &minor)))
+        return ret;
+
+    if (minor >= max_devices)
+        return -EINVAL;
+
+    mutex_lock(&devices_lock);
+    if (devices[minor])
+        chardev_remove(devices[minor]);
+    else
+        ret = -ENODEV;
+    mutex_unlock(&devices_lock);
+
+    if (ret)
+        return ret;
+
+    printk(KERN_INFO "Eliminado /dev/%s%u\n", DEVICE_NAME, minor);
+    return count;
+}
+static CLASS_ATTR_WO(remove);
+
+/* Remove every instance left. Must hold devices_lock. */
+static void chardev_remove_all(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < max_devices; i++)
+        if (devices[i])
+            chardev_remove(devices[i]);
+}
+
 /*
  * This function is called when the module is loaded
  */
 int init_module(void)
 {
-    int major;      /* Major number assigned to our device driver */
-    int minor;      /* Minor number assigned to the associated character device */
     int ret;
-    struct device_data* ddata[DEVICE_COUNT];
+    int i;
+
+    if (max_devices == 0 || max_devices > MINORMASK + 1 || nr_devices > max_devices) {
+        pr_err("Invalid nr_devices=%u / max_devices=%u\n", nr_devices, max_devices);
+        return -EINVAL;
+    }
 
     /* Get available (major,minor) range */
-    if ((ret = alloc_chrdev_region (&start, 0, DEVICE_COUNT, DEVICE_NAME))) {
+    if ((ret = alloc_chrdev_region (&start, 0, max_devices, DEVICE_NAME))) {
         printk(KERN_INFO "Can't allocate chrdev_region()");
         return ret;
     }
 
-    /* Create associated cdev */
-    if ((chardev = cdev_alloc()) == NULL) {
-        printk(KERN_INFO "cdev_alloc() failed ");
+    if ((devices = kcalloc(max_devices, sizeof(*devices), GFP_KERNEL)) == NULL) {
         ret = -ENOMEM;
         goto error_alloc;
     }
 
-    cdev_init(chardev, &fops);
-
-    if ((ret = cdev_add(chardev, start, DEVICE_COUNT))) {
-        printk(KERN_INFO "cdev_add() failed ");
-        goto error_add;
-    }
-
     /* Create custom class */
     class = class_create(THIS_MODULE, CLASS_NAME);
 
@@ -118,76 +386,42 @@ int init_module(void)
     /* Establish function that will take care of setting up permissions for device file */
     class->devnode = cool_devnode;
 
-    // Necesitamos el major para luego ir vairando los minor en funcion de los distintos dispositivos
-    major = MAJOR(start);
+    if ((ret = class_create_file(class, &class_attr_create)))
+        goto error_create_file;
 
-    printk(KERN_INFO "I was assigned major number %d. To talk to\n", major);
+    if ((ret = class_create_file(class, &class_attr_remove)))
+        goto error_remove_file;
 
-    dev_t dev;
+    printk(KERN_INFO "I was assigned major number %d. To talk to\n", MAJOR(start));
 
-    int i;
-    for(i = 0; i<DEVICE_COUNT; i++) {
-        /* Allocate device state structure and zero fill it */
-        if ((ddata[i] = kzalloc(sizeof(struct device_data), GFP_KERNEL)) == NULL) {
-            ret = -ENOMEM;
-            goto error_alloc_state;
-        }
-	
-	printk(KERN_INFO "Memoria reservada para el driver_data %d\n", i);
-
-        /* Proper initialization */
-        ddata[i]->Device_Open = 0;
-        ddata[i]->counter = 0;
-        ddata[i]->msg_Ptr = NULL;
-
-        // TODO: CAMBIAR ESTO POR MACRO QUE NOS DE UN MAJOR MINOR DISTINTO        
-        
-        dev = MKDEV(major, i);
-        ddata[i]->major_minor = dev;
-        
-        /* Creating device */
-        ddata[i]->device = device_create(class, NULL, ddata[i]->major_minor, ddata[i], "%s%d", DEVICE_NAME, i);
-	
-	    printk(KERN_INFO "Creo el dispositivo %d\n", i);
-
-        if (IS_ERR(ddata[i]->device)) {
-            pr_err("Device_create %d failed\n", i);
-            ret = PTR_ERR(ddata[i]->device);
+    mutex_lock(&devices_lock);
+    for (i = 0; i < nr_devices; i++) {
+        if ((ret = chardev_create(i)) < 0) {
+            mutex_unlock(&devices_lock);
             goto error_device;
         }
 
         printk(KERN_INFO "the driver try to cat and echo to /dev/%s%d.\n", DEVICE_NAME, i);
     }
-    
+    mutex_unlock(&devices_lock);
+
     printk(KERN_INFO "Remove the module when done.\n");
 
     return 0;
 
 error_device:
-    while (i--)  {
-        device_destroy(class, ddata[i]->major_minor);
-        kfree(ddata[i]);
-    }
-error_alloc_state:
-    // Si en el segundo dio error, el primero ya estaba creado, luego hay que hacer kfree desde i - 1;
-    i -= 1;
-    while (i >= 0)  {
-        device_destroy(class, ddata[i]->major_minor);
-        kfree(ddata[i]);
-    }
+    class_remove_file(class, &class_attr_remove);
+error_remove_file:
+    class_remove_file(class, &class_attr_create);
+error_create_file:
+    mutex_lock(&devices_lock);
+    chardev_remove_all();
+    mutex_unlock(&devices_lock);
     class_destroy(class);
 error_class:
-    /* Destroy chardev */
-    if (chardev) {
-        cdev_del(chardev);
-        chardev = NULL;
-    }
-error_add:
-    /* Destroy partially initialized chardev */
-    if (chardev)
-        kobject_put(&chardev->kobj);
+    kfree(devices);
 error_alloc:
-    unregister_chrdev_region(start, 1);
+    unregister_chrdev_region(start, max_devices);
 
     return ret;
 }
@@ -197,41 +431,27 @@ error_alloc:
  */
 void cleanup_module(void)
 {
-    struct device* device;
-    struct device_data* ddata;
-    dev_t dev;
-    int i;
-    for (i = 0; i < DEVICE_COUNT; i++) {
-        dev = MKDEV(MAJOR(start), i);
-        device = class_find_device_by_devt(class, dev);
-
-        /**
-        * Unregister/destroy the device
-        *
-        * Free up device private data too.
-        * **/
-        if (device) {
-            /* Retrieve device private data */
-            ddata = dev_get_drvdata(device);
-
-            if (ddata)
-                kfree(ddata);
-
-            device_destroy(class, device->devt);
-        }
-    }
+    /* Primero los ficheros de control, para que nadie cree mas dispositivos */
+    class_remove_file(class, &class_attr_remove);
+    class_remove_file(class, &class_attr_create);
+
+    /**
+    * Unregister/destroy every device. Its private data is freed by
+    * device_data_release() once nothing references it.
+    * **/
+    mutex_lock(&devices_lock);
+    chardev_remove_all();
+    mutex_unlock(&devices_lock);
 
     /* quitamos la clase */ 
     class_destroy(class);
 
-    /* Destroy chardev */
-    if (chardev)
-        cdev_del(chardev);
+    kfree(devices);
 
     /*
     * Release major minor pair
     */
-    unregister_chrdev_region(start, DEVICE_COUNT);
+    unregister_chrdev_region(start, max_devices);
     
     printk(KERN_INFO "El modulo ha sido retirado del kernel satisfactoriamente\n");
 }
@@ -242,31 +462,27 @@ void cleanup_module(void)
  */
 static int device_open(struct inode *inode, struct file *file)
 {
-    struct device* device;
-    struct device_data* ddata;
-
-    /* Retrieve device from major minor of the device file */
-    device = class_find_device_by_devt(class, inode->i_rdev);
-
-    if (!device)
-        return -ENODEV;
-
-    /* Retrieve driver's private data from device */
-    ddata = dev_get_drvdata(device);
-
-    if (!ddata)
-        return -ENODEV;
-
-    if (ddata->Device_Open)
-        return -EBUSY;
-
-    ddata->Device_Open++;
-
-    /* Initialize msg */
-    sprintf(ddata->msg, "I already told you %d times Hello world!\n", ddata->counter++);
+    /*
+     * The inode points to the cdev embedded in our instance: O(1) and
+     * without taking any extra reference (chrdev_open already holds one)
+     */
+    struct device_data* ddata = container_of(inode->i_cdev, struct device_data, cdev);
 
-    /* Initially, this points to the beginning of the message */
-    ddata->msg_Ptr = ddata->msg;
+    /*
+     * Any number of processes may have the device open at once. Each open
+     * file has its own position (f_pos, passed to read_iter/write_iter as
+     * ki_pos), so readers never move each other's cursor; the byte store
+     * itself is protected by ddata->lock.
+     */
+    atomic_inc(&ddata->Device_Open);
+    this_cpu_inc(ddata->stats->opens);
+
+    /* echo > /dev/chardevN vacia el dispositivo, como con un fichero */
+    if ((file->f_mode & FMODE_WRITE) && (file->f_flags & O_TRUNC)) {
+        down_write(&ddata->lock);
+        ddata->size = 0;
+        up_write(&ddata->lock);
+    }
 
     /* save our object in the file's private structure */
     file->private_data = ddata;
@@ -287,7 +503,7 @@ static int device_release(struct inode *inode, struct file *file)
     if (ddata == NULL)
         return -ENODEV;
     
-    ddata->Device_Open--;       /* We're now ready for our next caller */
+    atomic_dec(&ddata->Device_Open);
 
     /*
      * Decrement the usage count, or else once you opened the file, you'll
@@ -299,59 +515,110 @@ static int device_release(struct inode *inode, struct file *file)
 }
 
 /*
- * Called when a process, which already opened the dev file, attempts to
- * read from it.
+ * Move the file position. SEEK_END is relative to the bytes written so
+ * far; no position beyond the capacity is allowed.
  */
-static ssize_t device_read(struct file *filp,   /* see include/linux/fs.h   */
-                           char *buffer,    /* buffer to fill with data */
-                           size_t length,   /* length of the buffer     */
-                           loff_t * offset)
+static loff_t device_llseek(struct file *filp, loff_t offset, int whence)
 {
-    /*
-     * Number of bytes actually written to the buffer
-     */
-    int bytes_to_read = length;
     struct device_data* ddata = filp->private_data;
+    loff_t size;
 
-    if (ddata == NULL)
-        return -ENODEV;
+    down_read(&ddata->lock);
+    size = ddata->size;
+    up_read(&ddata->lock);
 
-    /*
-     * If we're at the end of the message,
-     * return 0 -> end of file
-     */
-    if (*(ddata->msg_Ptr) == 0)
-        return 0;
+    return generic_file_llseek_size(filp, offset, whence, ddata->capacity, size);
+}
 
-    /* Make sure we don't read more chars than
-    * those remaining to read
-    */
-    if (bytes_to_read > strlen(ddata->msg_Ptr))
-        bytes_to_read = strlen(ddata->msg_Ptr);
+/*
+ * Called when a process, which already opened the dev file, attempts to
+ * read from it: read(), pread() and readv()/preadv() all end up here, with
+ * the whole user vector in one iov_iter.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct device_data* ddata = iocb->ki_filp->private_data;
+    ktime_t t0 = ktime_get();
+    loff_t pos = iocb->ki_pos;
+    size_t bytes_to_read, copied = 0;
+    ssize_t ret = 0;
+    unsigned long us;
+
+    down_read(&ddata->lock);
+
+    /* Past the last byte written -> end of file */
+    if (pos >= ddata->size) {
+        up_read(&ddata->lock);
+        goto out;
+    }
 
-    /*
-     * Actually transfer the data onto the userspace buffer.
-     * For this task we use copy_to_user() due to security issues
-     */
-    if (copy_to_user(buffer, ddata->msg_Ptr, bytes_to_read))
-        return -EFAULT;
+    bytes_to_read = min_t(size_t, iov_iter_count(to), ddata->size - pos);
 
-    /* Update the pointer for the next read operation */
-    ddata->msg_Ptr += bytes_to_read;
+    /* Copies to every segment of the vector; stops at the first fault */
+    copied = copy_to_iter(ddata->data + pos, bytes_to_read, to);
 
-    /*
-     * The read operation returns the actual number of bytes
-     * we copied  in the user's buffer
-     */
-    return bytes_to_read;
+    up_read(&ddata->lock);
+
+    if (copied == 0 && bytes_to_read > 0) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    iocb->ki_pos = pos + copied;
+    ret = copied;
+out:
+    us = ktime_us_delta(ktime_get(), t0);
+
+    /* this_cpu ops: no need to disable preemption around them */
+    this_cpu_inc(ddata->stats->reads);
+    this_cpu_add(ddata->stats->bytes_read, copied);
+    this_cpu_inc(ddata->stats->read_lat[us ? min(ilog2(us) + 1, NR_LAT_BUCKETS - 1) : 0]);
+
+    return ret;
 }
 
 /*
- * Called when a process writes to dev file: echo "hi" > /dev/chardev
+ * Called when a process writes to dev file: echo "hi" > /dev/chardev,
+ * pwrite() or writev(). The whole vector is stored under one lock, so
+ * readers never see half of it.
  */
-static ssize_t
-device_write(struct file *filp, const char *buff, size_t len, loff_t * off)
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    printk(KERN_ALERT "Sorry, this operation isn't supported.\n");
-    return -EPERM;
+    struct device_data* ddata = iocb->ki_filp->private_data;
+    size_t bytes_to_write, copied;
+    loff_t pos;
+
+    if (iov_iter_count(from) == 0)
+        return 0;
+
+    down_write(&ddata->lock);
+
+    pos = (iocb->ki_flags & IOCB_APPEND) ? ddata->size : iocb->ki_pos;
+
+    if (pos >= ddata->capacity) {
+        up_write(&ddata->lock);
+        return -ENOSPC;
+    }
+
+    bytes_to_write = min_t(size_t, iov_iter_count(from), ddata->capacity - pos);
+
+    /* Si se escribe despues del final, el hueco se lee como ceros */
+    if (pos > ddata->size)
+        memset(ddata->data + ddata->size, 0, pos - ddata->size);
+
+    copied = copy_from_iter(ddata->data + pos, bytes_to_write, from);
+
+    if (pos + copied > ddata->size)
+        ddata->size = pos + copied;
+
+    up_write(&ddata->lock);
+
+    this_cpu_inc(ddata->stats->writes);
+    this_cpu_add(ddata->stats->bytes_written, copied);
+
+    if (copied == 0)
+        return -EFAULT;
+
+    iocb->ki_pos = pos + copied;
+    return copied;
 }
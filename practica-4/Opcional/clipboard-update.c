@@ -4,9 +4,23 @@
 #include <linux/cdev.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/crypto.h>
+#include <linux/lz4.h>
+#include <linux/bitmap.h>
+#include <linux/highmem.h>
 #include <linux/version.h>
+#include "clipboard-update.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,1)
 #define __cconst__ const
 #else
@@ -17,10 +31,32 @@ MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Clipboard-update Kernel Module with Semaphores - FDI-UCM");
 MODULE_AUTHOR("Juan Carlos Saez");
 
-#define BUFFER_LENGTH       PAGE_SIZE
 #define DEVICE_NAME "clipboard_update" /* Dev name as it appears in /proc/devices   */
 #define CLASS_NAME "clip"
 
+/* Largest clipboard contents accepted, in bytes */
+static unsigned long max_size = 64UL << 20;
+module_param(max_size, ulong, 0444);
+MODULE_PARM_DESC(max_size, "Maximum clipboard size in bytes (default 64 MiB)");
+
+/* Number of past versions kept for slow readers */
+static unsigned int history = 8;
+module_param(history, uint, 0444);
+MODULE_PARM_DESC(history, "Number of versions kept in the history ring (default 8)");
+
+/* Upper bound on named slots, as they live until the module is removed */
+static unsigned int max_slots = 64;
+module_param(max_slots, uint, 0444);
+MODULE_PARM_DESC(max_slots, "Maximum number of named clipboard slots (default 64)");
+
+/* Compress published contents of at least this size (0 = never) */
+static unsigned long compress_threshold = 0;
+module_param(compress_threshold, ulong, 0444);
+MODULE_PARM_DESC(compress_threshold, "Compress contents of at least this many bytes with LZ4 (default 0 = never)");
+
+#define DEFAULT_SLOT "default"
+#define SLOT_HASH_BITS 6
+
 /*
  * Global variables are declared as static, so are global within the file.
  */
@@ -29,97 +65,1015 @@ static dev_t start;
 static struct cdev* chardev = NULL;
 static struct class* class = NULL;
 static struct device* device = NULL;
-static char *clipboard;  // Space for the "clipboard"
 
-/* Semaphores */
-static struct semaphore sem_lock;    // Semaphore as a mutex (lock)
-static struct semaphore sem_waiting; // Semaphore to block readers (initially 0)
+/*
+ * Every update publishes a new immutable version of the clipboard.
+ * Readers take a reference to the current version under rcu_read_lock()
+ * and copy it out without any lock; writers swap the pointer with
+ * rcu_assign_pointer() and the old version is freed when its last
+ * reader drops it.
+ *
+ * Contents are kept in a list of individual pages, so large payloads
+ * don't need a contiguous allocation. Large versions may instead be kept
+ * LZ4-compressed; their pages are then a decompressed cache that exists
+ * only while somebody is reading or mapping them (raw_users > 0).
+ */
+struct clip_version {
+    struct kref ref;
+    struct rcu_head rcu;
+    unsigned long gen;      /* Version number, increased on every update */
+    size_t len;             /* Number of valid bytes */
+    unsigned long nr_pages; /* Pages allocated in pages[] */
+    unsigned long cap;      /* Capacity of pages[] */
+    struct page **pages;
+    void *zdata;            /* Compressed contents, NULL if kept raw */
+    size_t zlen;
+    struct mutex cache_lock;/* Protects pages of compressed versions */
+    unsigned int raw_users; /* Users of pages[], see clip_version_get_raw() */
+};
 
-/* Counter for processes waiting on the sem_waiting semaphore */
-static int waiting_readers = 0;
+/*
+ * Named clipboards selected with CLIP_IOC_SLOT. Each slot has its own
+ * contents, history, writer lock and waiters, so unrelated users don't
+ * contend with each other. Files start on the "default" slot.
+ */
+struct clip_slot {
+    char name[CLIP_SLOT_NAME_LEN];
+    struct hlist_node node;
 
-static ssize_t clipboard_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-    int available_space = BUFFER_LENGTH - 1;
+    struct clip_version __rcu *clipboard; // Current contents of the "clipboard"
 
-    if ((*off) > 0) /* The application can write in this entry just once !! */
-        return 0;
+    /*
+     * History ring with the last versions: version gen lives in ring[gen % history].
+     * Each entry holds its own reference, so a version stays available to slow
+     * readers until it is overwritten by the version history generations later.
+     */
+    struct clip_version __rcu **ring;
 
-    if (len > available_space) {
-        printk(KERN_INFO "clipboard: not enough space!!\n");
-        return -ENOSPC;
+    struct semaphore sem_lock;    // Semaphore as a mutex (lock) between writers
+
+    /*
+     * Readers sleep here until the generation of the clipboard moves past the
+     * last one they saw, so no update can be missed and nobody is woken for
+     * nothing.
+     */
+    wait_queue_head_t wq;
+};
+
+/* Slots are only added at run time and freed on module removal */
+static DEFINE_HASHTABLE(slots, SLOT_HASH_BITS);
+static DEFINE_MUTEX(slots_lock);
+static unsigned int nr_slots = 0;
+static struct clip_slot *default_slot = NULL;
+
+/* LZ4 transform; its workspace is per tfm so calls are serialized */
+static struct crypto_comp *comp_tfm = NULL;
+static DEFINE_MUTEX(comp_lock);
+
+/* Per-open state */
+struct clip_file {
+    struct clip_slot *slot;     /* Clipboard this file reads from and writes to */
+    struct mutex lock;          /* Serializes threads sharing this file */
+    unsigned long next_gen;     /* Next generation this reader hasn't read */
+    struct clip_version *snap;  /* Version being read, taken at offset 0 */
+    bool snap_raw;              /* Whether we hold the pages of snap */
+    struct clip_version *staged;/* Contents being written, published at close */
+    spinlock_t map_lock;        /* Protects map; never held across user copies */
+    struct clip_version *map;   /* Version selected by CLIP_IOC_INFO for mmap() */
+    bool patch;                 /* Writes edit a copy of the current contents */
+    unsigned long *cow;         /* Pages of staged still shared with its base */
+    unsigned long nr_cow;       /* Bits in cow */
+};
+
+static struct clip_version *clip_version_alloc(void) {
+    struct clip_version *v;
+
+    if ((v = kzalloc(sizeof(struct clip_version), GFP_KERNEL)) == NULL)
+        return NULL;
+
+    kref_init(&v->ref);
+    mutex_init(&v->cache_lock);
+
+    return v;
+}
+
+static void clip_version_drop_pages(struct clip_version *v) {
+    unsigned long i;
+
+    for (i = 0; i < v->nr_pages; i++)
+        put_page(v->pages[i]);
+
+    kvfree(v->pages);
+    v->pages = NULL;
+    v->nr_pages = 0;
+    v->cap = 0;
+}
+
+static void clip_version_free_rcu(struct rcu_head *rcu) {
+    struct clip_version *v = container_of(rcu, struct clip_version, rcu);
+
+    clip_version_drop_pages(v);
+    kvfree(v->zdata);
+    kfree(v);
+}
+
+static void clip_version_release(struct kref *ref) {
+    struct clip_version *v = container_of(ref, struct clip_version, ref);
+
+    /* A reader may still be between rcu_dereference() and kref_get() */
+    call_rcu(&v->rcu, clip_version_free_rcu);
+}
+
+static void clip_version_put(struct clip_version *v) {
+    kref_put(&v->ref, clip_version_release);
+}
+
+/*
+ * Return a reference to version gen without taking any lock. If it has
+ * already dropped out of the history, return the oldest version still kept;
+ * if it hasn't been published yet, the current one.
+ */
+static struct clip_version *clip_version_get(struct clip_slot *slot, unsigned long gen) {
+    struct clip_version *v;
+    unsigned long cur;
+
+    rcu_read_lock();
+    for (;;) {
+        cur = rcu_dereference(slot->clipboard)->gen;
+
+        /* Never past the current version, whatever the caller asked for */
+        if (gen > cur)
+            gen = cur;
+
+        /* The reader was lapped: resume at the oldest version kept */
+        if (cur - gen >= history)
+            gen = cur - history + 1;
+
+        v = rcu_dereference(slot->ring[gen % history]);
+
+        /* Not in the ring (can't happen once clamped): take the current one */
+        if (!v) {
+            v = rcu_dereference(slot->clipboard);
+            gen = v->gen;
+        }
+
+        /* Retry if a writer recycled the slot under our feet */
+        if (v->gen == gen && kref_get_unless_zero(&v->ref))
+            break;
     }
+    rcu_read_unlock();
 
-    /* Lock critical section */
-    if (down_interruptible(&sem_lock))
-        return -ERESTARTSYS;
+    return v;
+}
+
+/* Return a reference to the current version without taking any lock */
+static struct clip_version *clip_version_get_current(struct clip_slot *slot) {
+    struct clip_version *v;
+
+    rcu_read_lock();
+    do {
+        /* Retry if a writer replaced and released it under our feet */
+        v = rcu_dereference(slot->clipboard);
+    } while (!kref_get_unless_zero(&v->ref));
+    rcu_read_unlock();
+
+    return v;
+}
+
+/* Make room for needed entries in the page list of v */
+static int clip_version_grow(struct clip_version *v, unsigned long needed) {
+    struct page **pages;
+    unsigned long cap;
+
+    if (needed > v->cap) {
+        /* Grow the page list geometrically to keep appends cheap */
+        cap = max(needed, 2 * v->cap);
+        cap = min(cap, DIV_ROUND_UP(max_size, PAGE_SIZE));
 
-    /* Transfer data from user to kernel space */
-    if (copy_from_user(&clipboard[0], buf, len)) {
-        up(&sem_lock); // Release the lock in case of error
-        return -EFAULT;
+        if ((pages = kvcalloc(cap, sizeof(struct page *), GFP_KERNEL)) == NULL)
+            return -ENOMEM;
+
+        if (v->pages)
+            memcpy(pages, v->pages, v->nr_pages * sizeof(struct page *));
+
+        kvfree(v->pages);
+        v->pages = pages;
+        v->cap = cap;
     }
 
-    clipboard[len] = '\0'; /* Add the `\0' */
-    *off += len;           /* Update the file position indicator */
+    return 0;
+}
+
+/* Make sure a version being written has pages to hold size bytes */
+static int clip_version_reserve(struct clip_version *v, size_t size) {
+    unsigned long needed = DIV_ROUND_UP(size, PAGE_SIZE);
+    int ret;
+
+    if ((ret = clip_version_grow(v, needed)))
+        return ret;
 
-    /* Wake up all waiting readers */
-    while (waiting_readers > 0) {
-        up(&sem_waiting);  // Increment semaphore to unblock readers
-        waiting_readers--; // Decrease the counter of waiting readers
+    while (v->nr_pages < needed) {
+        struct page *page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+        if (!page)
+            return -ENOMEM;
+
+        v->pages[v->nr_pages++] = page;
     }
 
-    printk(KERN_INFO "clipboard: clipboard updated.\n");
+    return 0;
+}
+
+static int clip_copy_to_user(struct clip_version *v, char __user *buf, loff_t pos, size_t count) {
+    while (count > 0) {
+        size_t offset = pos & ~PAGE_MASK;
+        size_t chunk = min_t(size_t, count, PAGE_SIZE - offset);
+
+        if (copy_to_user(buf, page_address(v->pages[pos >> PAGE_SHIFT]) + offset, chunk))
+            return -EFAULT;
+
+        buf += chunk;
+        pos += chunk;
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+static int clip_copy_from_user(struct clip_version *v, const char __user *buf, loff_t pos, size_t count) {
+    while (count > 0) {
+        size_t offset = pos & ~PAGE_MASK;
+        size_t chunk = min_t(size_t, count, PAGE_SIZE - offset);
+
+        if (copy_from_user(page_address(v->pages[pos >> PAGE_SHIFT]) + offset, buf, chunk))
+            return -EFAULT;
+
+        buf += chunk;
+        pos += chunk;
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Replace the pages of a version about to be published by their LZ4 image,
+ * if that saves at least one page. On any failure the version stays raw.
+ */
+static void clip_version_compress(struct clip_version *v) {
+    unsigned int zlen;
+    void *src, *tmp, *z = NULL;
+    int ret;
+
+    if (!comp_tfm || v->len == 0 || v->len < compress_threshold)
+        return;
+
+    if ((src = vmap(v->pages, v->nr_pages, VM_MAP, PAGE_KERNEL)) == NULL)
+        return;
+
+    zlen = LZ4_COMPRESSBOUND(v->len);
+
+    if ((tmp = kvmalloc(zlen, GFP_KERNEL)) == NULL) {
+        vunmap(src);
+        return;
+    }
+
+    mutex_lock(&comp_lock);
+    ret = crypto_comp_compress(comp_tfm, src, v->len, tmp, &zlen);
+    mutex_unlock(&comp_lock);
+
+    vunmap(src);
+
+    /* Keep only the compressed bytes, not the worst-case bound */
+    if (!ret && zlen + PAGE_SIZE <= v->nr_pages * PAGE_SIZE && (z = kvmalloc(zlen, GFP_KERNEL))) {
+        memcpy(z, tmp, zlen);
+        clip_version_drop_pages(v);
+        v->zdata = z;
+        v->zlen = zlen;
+    }
+
+    kvfree(tmp);
+}
+
+/* Rebuild the pages of a compressed version. Called with cache_lock held */
+static int clip_version_inflate(struct clip_version *v) {
+    unsigned int dlen;
+    void *dst;
+    int ret;
+
+    if ((ret = clip_version_reserve(v, v->len)))
+        goto error;
+
+    if ((dst = vmap(v->pages, v->nr_pages, VM_MAP, PAGE_KERNEL)) == NULL) {
+        ret = -ENOMEM;
+        goto error;
+    }
+
+    dlen = v->nr_pages * PAGE_SIZE;
+
+    mutex_lock(&comp_lock);
+    ret = crypto_comp_decompress(comp_tfm, v->zdata, v->zlen, dst, &dlen);
+    mutex_unlock(&comp_lock);
+
+    vunmap(dst);
+
+    if (!ret && dlen != v->len)
+        ret = -EIO;
+
+    if (ret)
+        goto error;
+
+    return 0;
+error:
+    clip_version_drop_pages(v);
+    return ret;
+}
+
+/*
+ * Make the pages of v available until the matching clip_version_put_raw().
+ * Compressed versions are decompressed once and shared by all their users.
+ */
+static int clip_version_get_raw(struct clip_version *v) {
+    int ret = 0;
+
+    mutex_lock(&v->cache_lock);
+
+    if (v->zdata && v->raw_users == 0)
+        ret = clip_version_inflate(v);
+
+    if (!ret)
+        v->raw_users++;
+
+    mutex_unlock(&v->cache_lock);
+
+    return ret;
+}
+
+static void clip_version_put_raw(struct clip_version *v) {
+    mutex_lock(&v->cache_lock);
+
+    /* Nobody needs the decompressed copy any more */
+    if (--v->raw_users == 0 && v->zdata)
+        clip_version_drop_pages(v);
+
+    mutex_unlock(&v->cache_lock);
+}
+
+static unsigned long clip_current_gen(struct clip_slot *slot) {
+    unsigned long gen;
+
+    rcu_read_lock();
+    gen = rcu_dereference(slot->clipboard)->gen;
+    rcu_read_unlock();
+
+    return gen;
+}
+
+/* True once version gen has been published */
+static bool clip_gen_published(struct clip_slot *slot, unsigned long gen) {
+    return (long)(clip_current_gen(slot) - gen) >= 0;
+}
+
+/* Make v the current version and wake up everybody waiting for it */
+static void clip_publish(struct clip_slot *slot, struct clip_version *v) {
+    struct clip_version *old, *evicted;
+    unsigned int idx;
+
+    /* Compress before taking the lock: it only depends on v */
+    clip_version_compress(v);
+
+    /* Lock critical section (can't fail: called from close()) */
+    down(&slot->sem_lock);
+
+    /* Publish the new version; sem_lock serializes writers */
+    old = rcu_dereference_protected(slot->clipboard, 1);
+    v->gen = old->gen + 1;
+
+    /* Fill the ring slot first: readers look it up after seeing the new gen */
+    idx = v->gen % history;
+    evicted = rcu_dereference_protected(slot->ring[idx], 1);
+    kref_get(&v->ref);
+    rcu_assign_pointer(slot->ring[idx], v);
+
+    rcu_assign_pointer(slot->clipboard, v);
+
+    printk(KERN_INFO "clipboard: slot %s updated (%zu bytes).\n", slot->name, v->len);
 
     /* Release the lock */
-    up(&sem_lock);
+    up(&slot->sem_lock);
 
-    return len;
+    /* Wake up readers and pollers of this slot; they all see a new generation */
+    wake_up_interruptible_all(&slot->wq);
+
+    /* Drop the references held on behalf of the clipboard pointer and the ring */
+    clip_version_put(old);
+    if (evicted)
+        clip_version_put(evicted);
 }
 
-static ssize_t clipboard_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
-    int nr_bytes;
+/* Drop the current version and the whole history of a slot */
+static void clip_slot_free(struct clip_slot *slot) {
+    struct clip_version *v;
+    unsigned int i;
 
-    if ((*off) > 0) /* Tell the application that there is nothing left to read */
-        return 0;
+    clip_version_put(rcu_dereference_protected(slot->clipboard, 1));
 
-    /* Increment the number of waiting readers */
-    waiting_readers++;
+    for (i = 0; i < history; i++) {
+        if ((v = rcu_dereference_protected(slot->ring[i], 1)))
+            clip_version_put(v);
+    }
 
-    /* Wait until clipboard is updated */
-    if (down_interruptible(&sem_waiting)) {
-        waiting_readers--; // Decrease counter if interrupted
-        return -ERESTARTSYS;
+    kfree(slot->ring);
+    kfree(slot);
+}
+
+static struct clip_slot *clip_slot_alloc(const char *name) {
+    struct clip_slot *slot;
+    struct clip_version *empty;
+
+    if ((slot = kzalloc(sizeof(struct clip_slot), GFP_KERNEL)) == NULL)
+        return NULL;
+
+    if ((slot->ring = kcalloc(history, sizeof(*slot->ring), GFP_KERNEL)) == NULL) {
+        kfree(slot);
+        return NULL;
     }
 
-    /* Lock critical section */
-    if (down_interruptible(&sem_lock)) {
+    /* Start with an empty version so readers never see a NULL clipboard */
+    if ((empty = clip_version_alloc()) == NULL) {
+        kfree(slot->ring);
+        kfree(slot);
+        return NULL;
+    }
+
+    strscpy(slot->name, name, CLIP_SLOT_NAME_LEN);
+    sema_init(&slot->sem_lock, 1);     // Binary semaphore (mutex)
+    init_waitqueue_head(&slot->wq);
+
+    /* Generation 0: referenced by both the clipboard pointer and the ring */
+    kref_get(&empty->ref);
+    RCU_INIT_POINTER(slot->ring[0], empty);
+    RCU_INIT_POINTER(slot->clipboard, empty);
+
+    return slot;
+}
+
+/* Find a slot by name, creating it if it doesn't exist yet */
+static struct clip_slot *clip_slot_get(const char *name) {
+    struct clip_slot *slot;
+    u32 key = full_name_hash(NULL, name, strlen(name));
+
+    mutex_lock(&slots_lock);
+
+    hash_for_each_possible(slots, slot, node, key) {
+        if (strcmp(slot->name, name) == 0)
+            goto out;
+    }
+
+    if (nr_slots >= max_slots) {
+        slot = ERR_PTR(-ENOSPC);
+        goto out;
+    }
+
+    if ((slot = clip_slot_alloc(name)) == NULL) {
+        slot = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+
+    hash_add(slots, &slot->node, key);
+    nr_slots++;
+out:
+    mutex_unlock(&slots_lock);
+    return slot;
+}
+
+/* Forget the version this file was reading */
+static void clip_file_drop_snap(struct clip_file *cf) {
+    if (!cf->snap)
+        return;
+
+    if (cf->snap_raw)
+        clip_version_put_raw(cf->snap);
+
+    clip_version_put(cf->snap);
+    cf->snap = NULL;
+    cf->snap_raw = false;
+}
+
+/*
+ * Select the version a later mmap() maps (NULL: the current one). mmap()
+ * runs with mmap_lock held, and read()/write() fault on user memory with
+ * cf->lock held, so mmap() only ever takes map_lock.
+ */
+static void clip_file_set_map(struct clip_file *cf, struct clip_version *v) {
+    struct clip_version *old;
+
+    if (v)
+        kref_get(&v->ref);
+
+    spin_lock(&cf->map_lock);
+    old = cf->map;
+    cf->map = v;
+    spin_unlock(&cf->map_lock);
+
+    if (old)
+        clip_version_put(old);
+}
+
+/* Take the current version as this file's snapshot and mark it as seen */
+static struct clip_version *clip_file_snapshot(struct clip_file *cf) {
+    struct clip_version *v = clip_version_get_current(cf->slot);
+
+    clip_file_drop_snap(cf);
+
+    cf->snap = v;
+    WRITE_ONCE(cf->next_gen, v->gen + 1);
+
+    return v;
+}
+
+/*
+ * Start the staged version of a patching writer as a copy of the current
+ * contents that shares all their pages. Pages are only copied when a write
+ * touches them (see clip_file_unshare()), so small edits of a large
+ * clipboard cost O(delta) instead of O(size).
+ */
+static int clip_file_clone_current(struct clip_file *cf) {
+    struct clip_version *base = clip_version_get_current(cf->slot);
+    struct clip_version *v;
+    unsigned long i;
+    int ret;
+
+    if ((ret = clip_version_get_raw(base)))
+        goto out_put;
+
+    if ((v = clip_version_alloc()) == NULL) {
+        ret = -ENOMEM;
+        goto out_raw;
+    }
+
+    if (base->nr_pages > 0) {
+        ret = clip_version_grow(v, base->nr_pages);
+
+        if (!ret && (cf->cow = bitmap_zalloc(base->nr_pages, GFP_KERNEL)) == NULL)
+            ret = -ENOMEM;
+
+        if (ret) {
+            clip_version_put(v);
+            goto out_raw;
+        }
+
+        for (i = 0; i < base->nr_pages; i++) {
+            get_page(base->pages[i]);
+            v->pages[i] = base->pages[i];
+        }
+
+        bitmap_fill(cf->cow, base->nr_pages);
+        cf->nr_cow = base->nr_pages;
+    }
+
+    v->nr_pages = base->nr_pages;
+    v->len = base->len;
+    cf->staged = v;
+out_raw:
+    clip_version_put_raw(base);
+out_put:
+    clip_version_put(base);
+    return ret;
+}
+
+/* Give the staged version private copies of the pages in [pos, pos + count) */
+static int clip_file_unshare(struct clip_file *cf, loff_t pos, size_t count) {
+    struct clip_version *v = cf->staged;
+    unsigned long first = pos >> PAGE_SHIFT;
+    unsigned long last = (pos + count - 1) >> PAGE_SHIFT;
+    unsigned long i;
+    struct page *page;
+
+    for (i = first; i <= last && i < cf->nr_cow; i++) {
+        if (!test_bit(i, cf->cow))
+            continue;
+
+        if ((page = alloc_page(GFP_KERNEL)) == NULL)
+            return -ENOMEM;
+
+        copy_highpage(page, v->pages[i]);
+        put_page(v->pages[i]);
+        v->pages[i] = page;
+        clear_bit(i, cf->cow);
+    }
+
+    return 0;
+}
+
+static int clipboard_open(struct inode *inode, struct file *filp) {
+    struct clip_file *cf;
+
+    if ((cf = kzalloc(sizeof(struct clip_file), GFP_KERNEL)) == NULL)
+        return -ENOMEM;
+
+    mutex_init(&cf->lock);
+    spin_lock_init(&cf->map_lock);
+
+    /* Readers wait for the next update after open(), as before */
+    cf->slot = default_slot;
+    cf->next_gen = clip_current_gen(cf->slot) + 1;
+
+    /*
+     * Like a regular file: without O_TRUNC, writes patch (or with O_APPEND
+     * extend) the current contents instead of replacing them.
+     */
+    cf->patch = (filp->f_mode & FMODE_WRITE) && !(filp->f_flags & O_TRUNC);
+
+    filp->private_data = cf;
+
+    return 0;
+}
+
+static int clipboard_release(struct inode *inode, struct file *filp) {
+    struct clip_file *cf = filp->private_data;
+
+    /* Everything written through this file becomes visible at once */
+    if (cf->staged)
+        clip_publish(cf->slot, cf->staged);
+
+    clip_file_drop_snap(cf);
+    clip_file_set_map(cf, NULL);
+    bitmap_free(cf->cow);
+
+    kfree(cf);
+    return 0;
+}
+
+/*
+ * Writes are streamed into a private version, at any offset and across as
+ * many write() calls as needed. Nothing is visible to readers until the
+ * file is closed. Opened without O_TRUNC, that private version starts as a
+ * copy-on-write clone of the current contents, so pwrite() patches bytes
+ * in place and O_APPEND adds to the end.
+ */
+static ssize_t clipboard_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
+    struct clip_file *cf = filp->private_data;
+    struct clip_version *v;
+    int ret;
+
+    if (len == 0)
+        return 0;
+
+    if (mutex_lock_interruptible(&cf->lock))
         return -ERESTARTSYS;
+
+    if (!cf->staged) {
+        if (cf->patch)
+            ret = clip_file_clone_current(cf);
+        else if ((cf->staged = clip_version_alloc()) == NULL)
+            ret = -ENOMEM;
+        else
+            ret = 0;
+
+        if (ret)
+            goto out;
+    }
+
+    v = cf->staged;
+
+    if (filp->f_flags & O_APPEND)
+        *off = v->len;
+
+    if ((*off) < 0 || (*off) + len > max_size) {
+        printk(KERN_INFO "clipboard: not enough space!!\n");
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    if ((ret = clip_version_reserve(v, (*off) + len)))
+        goto out;
+
+    /* Only the pages touched by this write stop being shared */
+    if ((ret = clip_file_unshare(cf, *off, len)))
+        goto out;
+
+    /* Transfer data from user to kernel space, outside any global lock */
+    if ((ret = clip_copy_from_user(v, buf, *off, len)))
+        goto out;
+
+    *off += len;           /* Update the file position indicator */
+    if (v->len < (*off))
+        v->len = *off;
+
+    ret = len;
+out:
+    mutex_unlock(&cf->lock);
+    return ret;
+}
+
+/*
+ * Whether a reader of cf waiting on slot can go on: the version it expects
+ * is out, or CLIP_IOC_SEEK/CLIP_IOC_SLOT changed what it expects. Checked
+ * without cf->lock.
+ */
+static bool clip_file_ready(struct clip_file *cf, struct clip_slot *slot) {
+    return READ_ONCE(cf->slot) != slot ||
+           clip_gen_published(slot, READ_ONCE(cf->next_gen));
+}
+
+static ssize_t clipboard_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+    struct clip_file *cf = filp->private_data;
+    struct clip_slot *slot;
+    struct clip_version *v;
+    size_t nr_bytes;
+    ssize_t ret;
+
+    for (;;) {
+        /*
+         * Reading from the start waits for the version this reader expects.
+         * Not with cf->lock held, or ioctls and mmap() on the same file
+         * would be stuck until the next update.
+         */
+        if ((*off) == 0) {
+            slot = READ_ONCE(cf->slot);
+            if (wait_event_interruptible(slot->wq, clip_file_ready(cf, slot)))
+                return -ERESTARTSYS;
+        }
+
+        if (mutex_lock_interruptible(&cf->lock))
+            return -ERESTARTSYS;
+
+        /* Another thread may have read it, or moved next_gen, meanwhile */
+        if ((*off) != 0 || clip_gen_published(cf->slot, cf->next_gen))
+            break;
+
+        mutex_unlock(&cf->lock);
+    }
+
+    /* Reading from the start moves on to the next version, in order */
+    if ((*off) == 0) {
+        /* Consistent snapshot: the version can't change while we hold it */
+        v = clip_version_get(cf->slot, cf->next_gen);
+
+        clip_file_drop_snap(cf);
+
+        cf->snap = v;
+        WRITE_ONCE(cf->next_gen, v->gen + 1);
     }
 
-    nr_bytes = strlen(clipboard);
+    v = cf->snap;
 
-    if (len < nr_bytes) {
-        up(&sem_lock); // Release the lock
-        return -ENOSPC;
+    /* Tell the application that there is nothing left to read */
+    if (!v || (*off) < 0 || (*off) >= v->len) {
+        ret = 0;
+        goto out;
     }
 
+    /* Compressed versions are decompressed on first read */
+    if (!cf->snap_raw) {
+        if ((ret = clip_version_get_raw(v)))
+            goto out;
+        cf->snap_raw = true;
+    }
+
+    nr_bytes = min_t(size_t, len, v->len - (*off));
+
     /* Transfer data from the kernel to userspace */
-    if (copy_to_user(buf, clipboard, nr_bytes)) {
-        up(&sem_lock); // Release the lock
-        return -EINVAL;
+    if (clip_copy_to_user(v, buf, *off, nr_bytes)) {
+        ret = -EFAULT;
+        goto out;
     }
 
     (*off) += nr_bytes; /* Update the file pointer */
+    ret = nr_bytes;
 
-    /* Release the lock */
-    up(&sem_lock);
+    /* Done with this version: let a decompressed copy go */
+    if ((*off) >= v->len) {
+        clip_version_put_raw(v);
+        cf->snap_raw = false;
+    }
+out:
+    mutex_unlock(&cf->lock);
+    return ret;
+}
+
+/*
+ * Mappings keep a reference to the version they show, so a new update
+ * never pulls pages out from under a reader; the old version is freed
+ * only after its last mapping goes away.
+ */
+static void clip_vm_open(struct vm_area_struct *vma) {
+    struct clip_version *v = vma->vm_private_data;
+
+    /* Already decompressed by the original mapping: this can't fail */
+    kref_get(&v->ref);
+    clip_version_get_raw(v);
+}
+
+static void clip_vm_close(struct vm_area_struct *vma) {
+    struct clip_version *v = vma->vm_private_data;
+
+    clip_version_put_raw(v);
+    clip_version_put(v);
+}
+
+static const struct vm_operations_struct clip_vm_ops = {
+    .open = clip_vm_open,
+    .close = clip_vm_close,
+};
+
+/*
+ * Map the version selected with CLIP_IOC_INFO (or the current one) read-only,
+ * so that readers can inspect large contents without copying them.
+ */
+static int clipboard_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct clip_file *cf = filp->private_data;
+    struct clip_version *v;
+    unsigned long nr_pages = vma_pages(vma);
+    unsigned long i;
+    int ret = 0;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+
+    /* Not cf->lock: see clip_file_set_map() */
+    spin_lock(&cf->map_lock);
+    if ((v = cf->map))
+        kref_get(&v->ref);
+    spin_unlock(&cf->map_lock);
+
+    if (!v)
+        v = clip_version_get_current(READ_ONCE(cf->slot));
+
+    if (vma->vm_pgoff >= DIV_ROUND_UP(v->len, PAGE_SIZE) ||
+        nr_pages > DIV_ROUND_UP(v->len, PAGE_SIZE) - vma->vm_pgoff) {
+        clip_version_put(v);
+        return -EINVAL;
+    }
+
+    if ((ret = clip_version_get_raw(v))) {
+        clip_version_put(v);
+        return ret;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    for (i = 0; i < nr_pages; i++) {
+        ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, v->pages[vma->vm_pgoff + i]);
+        if (ret) {
+            clip_version_put_raw(v);
+            clip_version_put(v);
+            return ret;
+        }
+    }
+
+    vma->vm_ops = &clip_vm_ops;
+    vma->vm_private_data = v;
+
+    return 0;
+}
+
+static long clipboard_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct clip_file *cf = filp->private_data;
+    struct clip_version *v;
+    struct clip_info info;
+    struct clip_slot_name sname;
+    struct clip_slot *slot, *old;
+    struct clip_stats stats;
+    unsigned int i;
+    unsigned long cur;
+    __u64 gen;
+
+    switch (cmd) {
+    case CLIP_IOC_INFO:
+        mutex_lock(&cf->lock);
+        v = clip_file_snapshot(cf);
+        clip_file_set_map(cf, v);
+        info.len = v->len;
+        info.gen = v->gen;
+        mutex_unlock(&cf->lock);
+
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+    case CLIP_IOC_SEEK:
+        if (copy_from_user(&gen, (void __user *)arg, sizeof(gen)))
+            return -EFAULT;
+
+        /* The next read from offset 0 returns version gen (or the oldest kept) */
+        mutex_lock(&cf->lock);
+
+        /*
+         * Clamp to [oldest kept, next to be published] before storing it:
+         * the target comes from user space and is wider than next_gen on
+         * 32-bit.
+         */
+        cur = clip_current_gen(cf->slot);
+        if (gen > (__u64)cur + 1)
+            gen = (__u64)cur + 1;
+        else if (cur >= history && gen < cur - history + 1)
+            gen = cur - history + 1;
+
+        WRITE_ONCE(cf->next_gen, gen);
+        clip_file_drop_snap(cf);
+        clip_file_set_map(cf, NULL);
+        filp->f_pos = 0;
+        slot = cf->slot;
+        mutex_unlock(&cf->lock);
+
+        /* A reader of this file may be waiting for another generation */
+        wake_up_interruptible_all(&slot->wq);
+        return 0;
+    case CLIP_IOC_STATS:
+        memset(&stats, 0, sizeof(stats));
+
+        /* Walk the history of this file's slot without stopping writers */
+        rcu_read_lock();
+        for (i = 0; i < history; i++) {
+            v = rcu_dereference(cf->slot->ring[i]);
+            if (!v)
+                continue;
 
-    return nr_bytes;
+            stats.versions++;
+            stats.raw_bytes += v->len;
+            if (v->zdata) {
+                stats.compressed++;
+                stats.stored_bytes += v->zlen;
+                stats.cached_bytes += READ_ONCE(v->nr_pages) * PAGE_SIZE;
+            } else {
+                stats.stored_bytes += READ_ONCE(v->nr_pages) * PAGE_SIZE;
+            }
+        }
+        rcu_read_unlock();
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    case CLIP_IOC_SLOT:
+        if (copy_from_user(&sname, (void __user *)arg, sizeof(sname)))
+            return -EFAULT;
+
+        sname.name[CLIP_SLOT_NAME_LEN - 1] = '\0';
+        if (sname.name[0] == '\0')
+            return -EINVAL;
+
+        slot = clip_slot_get(sname.name);
+        if (IS_ERR(slot))
+            return PTR_ERR(slot);
+
+        mutex_lock(&cf->lock);
+
+        /* Pending writes belong to the slot they were started on */
+        if (cf->staged) {
+            mutex_unlock(&cf->lock);
+            return -EBUSY;
+        }
+
+        /* Start over on the new slot: wait for its next update */
+        old = cf->slot;
+        WRITE_ONCE(cf->slot, slot);
+        WRITE_ONCE(cf->next_gen, clip_current_gen(slot) + 1);
+        clip_file_drop_snap(cf);
+        clip_file_set_map(cf, NULL);
+        filp->f_pos = 0;
+        mutex_unlock(&cf->lock);
+
+        /* Readers of this file waiting on the old slot must move over */
+        wake_up_interruptible_all(&old->wq);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Readable whenever there is a generation this reader hasn't read yet.
+ * Watchers using epoll should go back to offset 0 (lseek or pread) to
+ * read the new contents.
+ */
+static __poll_t clipboard_poll(struct file *filp, poll_table *wait) {
+    struct clip_file *cf = filp->private_data;
+
+    poll_wait(filp, &cf->slot->wq, wait);
+
+    if (clip_gen_published(cf->slot, cf->next_gen))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
 }
 
 static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = clipboard_open,
+    .release = clipboard_release,
     .read = clipboard_read,
     .write = clipboard_write,
+    .llseek = default_llseek,
+    .poll = clipboard_poll,
+    .mmap = clipboard_mmap,
+    .unlocked_ioctl = clipboard_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 static char *custom_devnode(__cconst__ struct device *dev, umode_t *mode) {
@@ -130,23 +1084,50 @@ static char *custom_devnode(__cconst__ struct device *dev, umode_t *mode) {
     return NULL;
 }
 
+static void clip_slots_free(void) {
+    struct clip_slot *slot;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe(slots, bkt, tmp, slot, node) {
+        hash_del(&slot->node);
+        clip_slot_free(slot);
+    }
+
+    nr_slots = 0;
+
+    /* Wait for pending call_rcu() callbacks before the module goes away */
+    rcu_barrier();
+}
+
 int init_clipboard_module(void) {
     int major;    /* Major number assigned to our device driver */
     int minor;    /* Minor number assigned to the associated character device */
     int ret;
 
-    clipboard = (char *)vmalloc(BUFFER_LENGTH);
+    if (history == 0 || max_slots == 0) {
+        printk(KERN_INFO "clipboard: history and max_slots must be at least 1\n");
+        return -EINVAL;
+    }
 
-    if (!clipboard) {
-        printk(KERN_INFO "Can't allocate clipboard memory");
-        return -ENOMEM;
+    if (compress_threshold > 0) {
+        comp_tfm = crypto_alloc_comp("lz4", 0, 0);
+
+        /* Not fatal: contents are just kept uncompressed */
+        if (IS_ERR(comp_tfm)) {
+            printk(KERN_INFO "clipboard: LZ4 not available, compression disabled\n");
+            comp_tfm = NULL;
+        }
     }
 
-    memset(clipboard, 0, BUFFER_LENGTH);
+    default_slot = clip_slot_get(DEFAULT_SLOT);
 
-    /* Initialize semaphores */
-    sema_init(&sem_lock, 1);     // Binary semaphore (mutex)
-    sema_init(&sem_waiting, 0);  // Semaphore initialized to 0
+    if (IS_ERR(default_slot)) {
+        printk(KERN_INFO "Can't allocate clipboard memory");
+        if (comp_tfm)
+            crypto_free_comp(comp_tfm);
+        return PTR_ERR(default_slot);
+    }
 
     /* Get available (major, minor) range */
     if ((ret = alloc_chrdev_region(&start, 0, 1, DEVICE_NAME))) {
@@ -215,7 +1196,9 @@ error_add:
 error_alloc:
     unregister_chrdev_region(start, 1);
 error_alloc_region:
-    vfree(clipboard);
+    clip_slots_free();
+    if (comp_tfm)
+        crypto_free_comp(comp_tfm);
 
     return ret;
 }
@@ -236,7 +1219,10 @@ void exit_clipboard_module(void) {
      */
     unregister_chrdev_region(start, 1);
 
-    vfree(clipboard);
+    clip_slots_free();
+
+    if (comp_tfm)
+        crypto_free_comp(comp_tfm);
 
     printk(KERN_INFO "Clipboard-update: Module unloaded.\n");
 }
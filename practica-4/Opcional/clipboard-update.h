@@ -0,0 +1,59 @@
+/*
+ * ioctl interface of the clipboard-update device, shared by the kernel
+ * module and user programs.
+ */
+#ifndef CLIPBOARD_UPDATE_H
+#define CLIPBOARD_UPDATE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Length and generation of the version selected by CLIP_IOC_INFO */
+struct clip_info {
+    __u64 len;
+    __u64 gen;
+};
+
+/* Memory used by the history of the file's slot, see CLIP_IOC_STATS */
+struct clip_stats {
+    __u64 versions;     /* Versions kept in the history */
+    __u64 compressed;   /* How many of them are stored compressed */
+    __u64 raw_bytes;    /* Sum of their uncompressed lengths */
+    __u64 stored_bytes; /* Memory holding them (compressed size or pages) */
+    __u64 cached_bytes; /* Decompressed copies currently in use by readers */
+};
+
+/* Name of a clipboard slot, NUL-terminated */
+#define CLIP_SLOT_NAME_LEN 32
+
+struct clip_slot_name {
+    char name[CLIP_SLOT_NAME_LEN];
+};
+
+#define CLIP_IOC_MAGIC 'c'
+
+/*
+ * Take a snapshot of the current version for this file and return its
+ * length and generation. A later mmap() on the same file maps exactly
+ * that version, read-only.
+ */
+#define CLIP_IOC_INFO _IOR(CLIP_IOC_MAGIC, 1, struct clip_info)
+
+/*
+ * Make the next read from offset 0 return the given generation, or the
+ * oldest one still kept in the history if it is gone already. A generation
+ * beyond the current one means the next update. Reads then continue with
+ * the following generations in order.
+ */
+#define CLIP_IOC_SEEK _IOW(CLIP_IOC_MAGIC, 2, __u64)
+
+/*
+ * Switch this file to the named slot, creating it on first use. Every
+ * slot is an independent clipboard; files start on "default".
+ */
+#define CLIP_IOC_SLOT _IOW(CLIP_IOC_MAGIC, 3, struct clip_slot_name)
+
+/* Raw and stored (possibly LZ4-compressed) sizes of the slot's history */
+#define CLIP_IOC_STATS _IOR(CLIP_IOC_MAGIC, 4, struct clip_stats)
+
+#endif /* CLIPBOARD_UPDATE_H */
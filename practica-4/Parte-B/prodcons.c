@@ -4,6 +4,12 @@
 #include <linux/kfifo.h>
 #include <linux/miscdevice.h>
 #include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/proc_fs.h>
+#include <linux/jiffies.h>
 
 
 MODULE_DESCRIPTION("Prodcons Kernel Module - LIN FDI-UCM");
@@ -13,8 +19,42 @@ MODULE_AUTHOR("Alejandro Orgaz");
 
 /* Defines necesarios para el modulo */
 #define MAX_BUF_ELEMS 8
-#define MAX_CHARS_AUX_BUF MAX_BUF_ELEMS * 2
+#define MAX_CHARS_AUX_BUF 32 /* Suficiente para "prio:valor" con dos int */
+#define MAX_BCAST_LINE 29    /* "overrun " + unsigned long de 64 bits + '\n' */
 #define DEVICE_NAME "prodcons"  /* Dev name as it appears in /proc/devices   */
+#define REDUCE_PROC_NAME "prodcons_reduce"
+#define MAX_REDUCERS 64
+#define REDUCER_POLL_MS 100     /* Cada cuanto mira un hilo ocioso si debe terminar */
+
+/* Parametros del modulo */
+static char *mode = "fifo";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "Modo del buffer: fifo (por defecto), broadcast o prio");
+
+static char *policy = "block";
+module_param(policy, charp, 0444);
+MODULE_PARM_DESC(policy, "Politica con consumidores lentos en modo broadcast: block (por defecto) u overrun");
+
+static int nr_reducers = 0;
+module_param(nr_reducers, int, 0444);
+MODULE_PARM_DESC(nr_reducers, "Hilos del kernel que consumen y agregan elementos (0 = desactivado)");
+
+static char *reducer = "sum";
+module_param(reducer, charp, 0444);
+MODULE_PARM_DESC(reducer, "Agregado calculado por los hilos: sum, count, min, max o rate");
+
+static int rate_window_ms = 1000;
+module_param(rate_window_ms, int, 0444);
+MODULE_PARM_DESC(rate_window_ms, "Ventana en ms del reductor rate (por defecto 1000)");
+
+enum prodcons_mode {
+    PRODCONS_FIFO,
+    PRODCONS_BROADCAST,
+    PRODCONS_PRIO,
+};
+
+static enum prodcons_mode pc_mode = PRODCONS_FIFO;
+
 /* Cabeceras de funciones usadas */
 int prodcons_init(void);
 void prodcons_exit(void);
@@ -46,23 +86,503 @@ static struct semaphore mtx;
 static struct semaphore elementos;
 static struct semaphore huecos;
 
+/*
+ * Modo prio: monticulo binario acotado a MAX_BUF_ELEMS que sustituye a la
+ * kfifo. Se protege con mtx y usa los mismos semaforos huecos/elementos,
+ * asi que la semantica de bloqueo es la del modo fifo.
+ */
+struct prio_item {
+    int prio;
+    int val;
+    unsigned long seq;  /* Orden de llegada: FIFO entre elementos de igual prioridad */
+};
+
+static struct prio_item heap[MAX_BUF_ELEMS];
+static int heap_size = 0;
+static unsigned long heap_seq = 0;
+
+/* Indica si a debe salir antes que b */
+static bool prio_before(const struct prio_item *a, const struct prio_item *b) {
+    if (a->prio != b->prio)
+        return a->prio > b->prio;
+    return (long)(a->seq - b->seq) < 0;
+}
+
+static void heap_swap(int i, int j) {
+    struct prio_item tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+/* Llamar con mtx cogido y tras haber reservado un hueco */
+static void heap_push(int prio, int val) {
+    int i = heap_size++;
+
+    heap[i].prio = prio;
+    heap[i].val = val;
+    heap[i].seq = heap_seq++;
+
+    while (i > 0 && prio_before(&heap[i], &heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* Llamar con mtx cogido y tras haber reservado un elemento */
+static int heap_pop(void) {
+    int val = heap[0].val;
+    int i = 0;
+    int child;
+
+    heap[0] = heap[--heap_size];
+
+    while ((child = 2 * i + 1) < heap_size) {
+        if (child + 1 < heap_size && prio_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!prio_before(&heap[child], &heap[i]))
+            break;
+        heap_swap(i, child);
+        i = child;
+    }
+
+    return val;
+}
+
+/* Saca un elemento de la cola. Llamar tras coger elementos y con mtx cogido */
+static int queue_out(void) {
+    int val;
+
+    if (pc_mode == PRODCONS_PRIO)
+        val = heap_pop();
+    else
+        kfifo_out(&cbuf, &val, sizeof(int));
+
+    return val;
+}
+
+/*
+ * Modo broadcast: un unico anillo en el que cada fichero abierto para
+ * lectura mantiene su propio cursor, de modo que todos los consumidores
+ * ven todos los elementos con una sola copia en el kernel.
+ *
+ * bcast_head cuenta los elementos insertados desde la carga del modulo.
+ * Como MAX_BUF_ELEMS es potencia de 2, el indice en el anillo sigue siendo
+ * coherente aunque el contador dé la vuelta.
+ */
+struct bcast_reader {
+    unsigned long cursor;       /* Siguiente elemento que leera este consumidor */
+    unsigned long overruns;     /* Elementos perdidos aun no notificados */
+    struct list_head links;
+};
+
+static int bcast_ring[MAX_BUF_ELEMS];
+static unsigned long bcast_head = 0;
+static bool bcast_block = true;    /* true: el productor espera al consumidor mas lento */
+static LIST_HEAD(bcast_readers);
+static DEFINE_SPINLOCK(bcast_lock);
+static DECLARE_WAIT_QUEUE_HEAD(bcast_readers_wq);
+static DECLARE_WAIT_QUEUE_HEAD(bcast_writers_wq);
+
+/* Retraso del consumidor mas lento. Llamar con bcast_lock cogido */
+static unsigned long bcast_max_lag(void) {
+    struct bcast_reader *r;
+    unsigned long lag = 0;
+
+    list_for_each_entry(r, &bcast_readers, links) {
+        if (bcast_head - r->cursor > lag)
+            lag = bcast_head - r->cursor;
+    }
+
+    return lag;
+}
+
+static bool bcast_has_room(void) {
+    bool room;
+
+    spin_lock(&bcast_lock);
+    room = !bcast_block || bcast_max_lag() < MAX_BUF_ELEMS;
+    spin_unlock(&bcast_lock);
+
+    return room;
+}
+
+static bool bcast_pending(struct bcast_reader *r) {
+    bool pending;
+
+    spin_lock(&bcast_lock);
+    pending = r->cursor != bcast_head || r->overruns > 0;
+    spin_unlock(&bcast_lock);
+
+    return pending;
+}
+
+static int bcast_insert(int val) {
+    for (;;) {
+        if (wait_event_interruptible(bcast_writers_wq, bcast_has_room()))
+            return -EINTR;
+
+        spin_lock(&bcast_lock);
+        /* Otro productor ha podido ocupar el hueco mientras despertabamos */
+        if (!bcast_block || bcast_max_lag() < MAX_BUF_ELEMS)
+            break;
+        spin_unlock(&bcast_lock);
+    }
+
+    bcast_ring[bcast_head % MAX_BUF_ELEMS] = val;
+    bcast_head++;
+
+    spin_unlock(&bcast_lock);
+
+    wake_up_interruptible(&bcast_readers_wq);
+
+    return 0;
+}
+
+/*
+ * Saca el siguiente elemento para el consumidor r. Si el consumidor se ha
+ * quedado atras (politica overrun) se devuelve 1 y en *lost el numero de
+ * elementos perdidos; en ese caso no se consume ningun elemento. En *pos
+ * queda la posicion del elemento sacado, para bcast_unread().
+ */
+static int bcast_extract(struct bcast_reader *r, int *val, unsigned long *lost,
+                         unsigned long *pos) {
+    for (;;) {
+        if (wait_event_interruptible(bcast_readers_wq, bcast_pending(r)))
+            return -EINTR;
+
+        spin_lock(&bcast_lock);
+        /* Otro hilo con el mismo fichero abierto ha podido adelantarse */
+        if (r->cursor != bcast_head || r->overruns > 0)
+            break;
+        spin_unlock(&bcast_lock);
+    }
+
+    if (bcast_head - r->cursor > MAX_BUF_ELEMS) {
+        r->overruns += bcast_head - r->cursor - MAX_BUF_ELEMS;
+        r->cursor = bcast_head - MAX_BUF_ELEMS;
+    }
+
+    if (r->overruns > 0) {
+        *lost = r->overruns;
+        r->overruns = 0;
+        spin_unlock(&bcast_lock);
+        return 1;
+    }
+
+    *val = bcast_ring[r->cursor % MAX_BUF_ELEMS];
+    *pos = r->cursor;
+    r->cursor++;
+
+    spin_unlock(&bcast_lock);
+
+    /* Puede que este consumidor fuera el que frenaba a los productores */
+    if (bcast_block)
+        wake_up_interruptible(&bcast_writers_wq);
+
+    return 0;
+}
+
+/*
+ * Devuelve al consumidor r lo que saco bcast_extract() si no se le pudo
+ * entregar. El elemento solo se recupera si sigue en el anillo y ningun
+ * otro hilo con el mismo fichero ha leido despues.
+ */
+static void bcast_unread(struct bcast_reader *r, int ret, unsigned long lost,
+                         unsigned long pos) {
+    spin_lock(&bcast_lock);
+    if (ret == 1)
+        r->overruns += lost;
+    else if (r->cursor == pos + 1 && bcast_head - pos <= MAX_BUF_ELEMS)
+        r->cursor = pos;
+    spin_unlock(&bcast_lock);
+
+    wake_up_interruptible(&bcast_readers_wq);
+}
+
+
+/*
+ * Hilos consumidores del kernel: vacian la cola (fifo o prio) compitiendo
+ * con los lectores de /dev/prodcons y acumulan un agregado que se publica
+ * en /proc/prodcons_reduce. Asi el espacio de usuario no paga un cambio de
+ * contexto por elemento cuando solo le interesa el resultado.
+ */
+enum reducer_kind {
+    REDUCE_SUM,
+    REDUCE_COUNT,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_RATE,
+};
+
+static const char *reducer_names[] = { "sum", "count", "min", "max", "rate" };
+
+static enum reducer_kind reduce_kind = REDUCE_SUM;
+static struct task_struct **reducer_threads = NULL;
+static struct proc_dir_entry *reduce_proc = NULL;
+static DEFINE_SPINLOCK(reduce_lock);
+
+/* Estado del agregado, protegido por reduce_lock */
+static long long reduce_acc = 0;            /* sum, min o max */
+static unsigned long reduce_items = 0;      /* Elementos procesados por los hilos */
+static unsigned long window_items = 0;      /* Elementos en la ventana actual (rate) */
+static unsigned long window_start = 0;      /* Inicio de la ventana actual en jiffies */
+static unsigned long window_rate = 0;       /* Elementos/s de la ultima ventana completa */
+
+/* Cierra la ventana de rate si ha vencido. Llamar con reduce_lock cogido */
+static void reduce_roll_window(void) {
+    unsigned long win = msecs_to_jiffies(rate_window_ms);
+
+    if (time_before(jiffies, window_start + win))
+        return;
+
+    /* Si ha pasado mas de una ventana sin elementos, el ritmo es 0 */
+    if (time_before(jiffies, window_start + 2 * win))
+        window_rate = window_items * 1000 / rate_window_ms;
+    else
+        window_rate = 0;
+
+    window_items = 0;
+    window_start = jiffies;
+}
+
+static void reduce_item(int val) {
+    spin_lock(&reduce_lock);
+
+    switch (reduce_kind) {
+    case REDUCE_SUM:
+        reduce_acc += val;
+        break;
+    case REDUCE_MIN:
+        if (reduce_items == 0 || val < reduce_acc)
+            reduce_acc = val;
+        break;
+    case REDUCE_MAX:
+        if (reduce_items == 0 || val > reduce_acc)
+            reduce_acc = val;
+        break;
+    case REDUCE_RATE:
+        reduce_roll_window();
+        window_items++;
+        break;
+    case REDUCE_COUNT:
+        break;
+    }
+
+    reduce_items++;
+
+    spin_unlock(&reduce_lock);
+}
+
+static int reducer_thread(void *data) {
+    int val;
+
+    while (!kthread_should_stop()) {
+        /* Con timeout para poder ver kthread_should_stop() con la cola vacia */
+        if (down_timeout(&elementos, msecs_to_jiffies(REDUCER_POLL_MS)))
+            continue;
+
+        down(&mtx);
+        val = queue_out();
+        up(&mtx);
+        up(&huecos);
+
+        reduce_item(val);
+    }
+
+    return 0;
+}
+
+static ssize_t reduce_proc_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
+    char auxbuf[128];
+    ssize_t size;
+    unsigned long items;
+    long long acc;
+    unsigned long rate;
+
+    if ((*off) > 0)
+        return 0;
+
+    spin_lock(&reduce_lock);
+    if (reduce_kind == REDUCE_RATE)
+        reduce_roll_window();
+    acc = reduce_acc;
+    items = reduce_items;
+    rate = window_rate;
+    spin_unlock(&reduce_lock);
+
+    size = sprintf(auxbuf, "reducer: %s\nthreads: %d\nitems: %lu\n",
+                   reducer_names[reduce_kind], nr_reducers, items);
+
+    switch (reduce_kind) {
+    case REDUCE_COUNT:
+        size += sprintf(auxbuf + size, "value: %lu\n", items);
+        break;
+    case REDUCE_RATE:
+        size += sprintf(auxbuf + size, "value: %lu items/s (window %d ms)\n", rate, rate_window_ms);
+        break;
+    case REDUCE_MIN:
+    case REDUCE_MAX:
+        /* Sin elementos no hay minimo ni maximo */
+        if (items == 0) {
+            size += sprintf(auxbuf + size, "value: -\n");
+            break;
+        }
+        fallthrough;
+    case REDUCE_SUM:
+        size += sprintf(auxbuf + size, "value: %lld\n", acc);
+        break;
+    }
+
+    if (len < size)
+        return -ENOSPC;
+
+    if (copy_to_user(buf, auxbuf, size))
+        return -EFAULT;
+
+    (*off) += size;
+
+    return size;
+}
+
+static const struct proc_ops reduce_proc_ops = {
+    .proc_read = reduce_proc_read,
+};
+
+static void reducers_stop(void) {
+    int i;
+
+    if (!reducer_threads)
+        return;
+
+    for (i = 0; i < nr_reducers; i++) {
+        if (reducer_threads[i])
+            kthread_stop(reducer_threads[i]);
+    }
+
+    kfree(reducer_threads);
+    reducer_threads = NULL;
+
+    if (reduce_proc) {
+        remove_proc_entry(REDUCE_PROC_NAME, NULL);
+        reduce_proc = NULL;
+    }
+}
+
+static int reducers_start(void) {
+    struct task_struct *t;
+    int i;
+
+    window_start = jiffies;
+
+    reducer_threads = kcalloc(nr_reducers, sizeof(struct task_struct *), GFP_KERNEL);
+    if (!reducer_threads)
+        return -ENOMEM;
+
+    reduce_proc = proc_create(REDUCE_PROC_NAME, 0444, NULL, &reduce_proc_ops);
+    if (!reduce_proc) {
+        reducers_stop();
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < nr_reducers; i++) {
+        t = kthread_run(reducer_thread, NULL, "prodcons_red/%d", i);
+        if (IS_ERR(t)) {
+            reducers_stop();
+            return PTR_ERR(t);
+        }
+        reducer_threads[i] = t;
+    }
+
+    return 0;
+}
 
 static int prodcons_open (struct inode *node, struct file *filp) {
+    struct bcast_reader *r;
+
+    /* En broadcast solo los lectores tienen cursor; los productores no frenan a nadie */
+    filp->private_data = NULL; /* misc_open() deja ahi el struct miscdevice */
+
+    if (pc_mode == PRODCONS_BROADCAST && (filp->f_mode & FMODE_READ)) {
+        r = kmalloc(sizeof(struct bcast_reader), GFP_KERNEL);
+        if (!r)
+            return -ENOMEM;
+
+        r->overruns = 0;
+
+        /* El consumidor empieza a ver los elementos insertados a partir de ahora */
+        spin_lock(&bcast_lock);
+        r->cursor = bcast_head;
+        list_add_tail(&r->links, &bcast_readers);
+        spin_unlock(&bcast_lock);
+
+        filp->private_data = r;
+    }
+
     try_module_get(THIS_MODULE);
     return 0;
 }
 
 static int prodcons_release(struct inode *node, struct file *filp) {
+    struct bcast_reader *r = filp->private_data;
+
+    if (r) {
+        spin_lock(&bcast_lock);
+        list_del(&r->links);
+        spin_unlock(&bcast_lock);
+        kfree(r);
+
+        /* Si era el consumidor mas lento, los productores pueden continuar */
+        wake_up_interruptible(&bcast_writers_wq);
+    }
+
     module_put(THIS_MODULE);
     return 0;
 }
 
+static ssize_t prodcons_read_bcast (struct file *filp, char __user *buf, size_t len, loff_t *off) {
+    struct bcast_reader *r = filp->private_data;
+    char auxbuf[MAX_CHARS_AUX_BUF + 16];
+    unsigned long lost = 0, pos = 0;
+    ssize_t size;
+    int val;
+    int ret;
+
+    /* Fichero abierto solo para escritura */
+    if (!r)
+        return -EBADF;
+
+    /* Antes de sacar nada: un buffer corto no debe hacer perder el elemento */
+    if (len < MAX_BCAST_LINE)
+        return -ENOSPC;
+
+    ret = bcast_extract(r, &val, &lost, &pos);
+    if (ret < 0)
+        return ret;
+
+    /* Un consumidor lento recibe primero cuantos elementos se ha perdido */
+    if (ret == 1)
+        size = sprintf(auxbuf, "overrun %lu\n", lost);
+    else
+        size = sprintf(auxbuf, "%i\n", val);
+
+    if (copy_to_user(buf, auxbuf, size)) {
+        bcast_unread(r, ret, lost, pos);
+        return -EFAULT;
+    }
+
+    /* El cursor propio sustituye a *off: se puede leer en bucle con el mismo fd */
+    return size;
+}
+
 
 static ssize_t prodcons_read (struct file *filp, char __user *buf, size_t len, loff_t *off) {
     int val;
     char auxbuf[MAX_CHARS_AUX_BUF+1];
     ssize_t size;
 
+    if (pc_mode == PRODCONS_BROADCAST)
+        return prodcons_read_bcast(filp, buf, len, off);
+
     if ((*off) > 0) {
         return 0;
     }
@@ -78,17 +598,17 @@ static ssize_t prodcons_read (struct file *filp, char __user *buf, size_t len, l
         return -EINTR;
     }
     
-    kfifo_out(&cbuf, &val, sizeof(int));
+    val = queue_out();
+
+    up (&mtx);
+    up(&huecos);
 
     size = sprintf(auxbuf, "%i\n", val);
 
     if (copy_to_user(buf, auxbuf, size)) {
-        return -ENOMEM;
+        return -EFAULT;
     }
 
-    up (&mtx);
-    up(&huecos);
-
     (*off) += len;
 
     return size;
@@ -97,19 +617,38 @@ static ssize_t prodcons_read (struct file *filp, char __user *buf, size_t len, l
 static ssize_t prodcons_write (struct file *filp, const char __user *buf, size_t len, loff_t *off) {
     char auxbuf[MAX_CHARS_AUX_BUF + 1];
     int val = 0;
+    int prio = 0;
+
+    if (len > MAX_CHARS_AUX_BUF) {
+        return -EINVAL;
+    }
 
     if (copy_from_user(auxbuf, buf, len)) {
         return -ENOMEM;
     }
     
     auxbuf[len] = '\0';
-    if (sscanf(auxbuf, "%d%*s", &val) != 1) {
-        printk(KERN_INFO "Argumento incorrecto al escribir\n");
-        return -EINVAL;
+
+    /* En modo prio se admite "prio:valor"; un valor sin prioridad va con prioridad 0 */
+    if (pc_mode != PRODCONS_PRIO || sscanf(auxbuf, "%d:%d", &prio, &val) != 2) {
+        prio = 0;
+        if (sscanf(auxbuf, "%d%*s", &val) != 1) {
+            printk(KERN_INFO "Argumento incorrecto al escribir\n");
+            return -EINVAL;
+        }
     }
 
     printk(KERN_INFO "Numero a insertar: %d", val);
 
+    if (pc_mode == PRODCONS_BROADCAST) {
+        int ret = bcast_insert(val);
+        if (ret)
+            return ret;
+
+        (*off) += len;
+        return len;
+    }
+
     // no dejamos que otro proceso escriba en los huecos
     if (down_interruptible(&huecos)) {
         return -EINTR;
@@ -120,7 +659,10 @@ static ssize_t prodcons_write (struct file *filp, const char __user *buf, size_t
         return -EINTR;
     }
 
-    kfifo_in(&cbuf, &val, sizeof(int));
+    if (pc_mode == PRODCONS_PRIO)
+        heap_push(prio, val);
+    else
+        kfifo_in(&cbuf, &val, sizeof(int));
     
     up(&mtx);
     up(&elementos);
@@ -133,6 +675,51 @@ static ssize_t prodcons_write (struct file *filp, const char __user *buf, size_t
 
 
 int prodcons_init(void) {
+    int ret;
+    int i;
+
+    if (strcmp(mode, "fifo") == 0) {
+        pc_mode = PRODCONS_FIFO;
+    } else if (strcmp(mode, "broadcast") == 0) {
+        pc_mode = PRODCONS_BROADCAST;
+    } else if (strcmp(mode, "prio") == 0) {
+        pc_mode = PRODCONS_PRIO;
+    } else {
+        printk(KERN_INFO "Modo desconocido: %s\n", mode);
+        return -EINVAL;
+    }
+
+    if (strcmp(policy, "block") == 0) {
+        bcast_block = true;
+    } else if (strcmp(policy, "overrun") == 0) {
+        bcast_block = false;
+    } else {
+        printk(KERN_INFO "Politica desconocida: %s\n", policy);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(reducer_names); i++) {
+        if (strcmp(reducer, reducer_names[i]) == 0)
+            break;
+    }
+
+    if (i == ARRAY_SIZE(reducer_names)) {
+        printk(KERN_INFO "Reductor desconocido: %s\n", reducer);
+        return -EINVAL;
+    }
+    reduce_kind = i;
+
+    if (nr_reducers < 0 || nr_reducers > MAX_REDUCERS || rate_window_ms <= 0) {
+        printk(KERN_INFO "Parametros de los hilos reductores incorrectos\n");
+        return -EINVAL;
+    }
+
+    /* En broadcast no hay cola que vaciar: cada lector tiene su cursor */
+    if (nr_reducers > 0 && pc_mode == PRODCONS_BROADCAST) {
+        printk(KERN_INFO "Los hilos reductores no estan disponibles en modo broadcast\n");
+        return -EINVAL;
+    }
+
 	if (kfifo_alloc(&cbuf, MAX_BUF_ELEMS*sizeof(int), GFP_KERNEL)) {
         return -ENOMEM;
 	}
@@ -141,14 +728,24 @@ int prodcons_init(void) {
     sema_init(&huecos, MAX_BUF_ELEMS);
     sema_init(&elementos, 0);
 
-    misc_register(&misc_prodcons);
+    if ((ret = misc_register(&misc_prodcons))) {
+        kfifo_free(&cbuf);
+        return ret;
+    }
+
+    if (nr_reducers > 0 && (ret = reducers_start())) {
+        misc_deregister(&misc_prodcons);
+        kfifo_free(&cbuf);
+        return ret;
+    }
 
-    printk(KERN_INFO "Modulo cargado correctamente\n");
+    printk(KERN_INFO "Modulo cargado correctamente (modo %s)\n", mode);
 
     return 0;
 }
 
 void prodcons_exit(void) {
+    reducers_stop();
     misc_deregister(&misc_prodcons);
     kfifo_free(&cbuf);
     printk(KERN_INFO "Modulo descargado correctamente\n");
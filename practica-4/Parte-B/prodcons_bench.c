@@ -0,0 +1,379 @@
+/*
+ * Benchmark de /dev/prodcons con N productores y M consumidores.
+ *
+ * Compilar: gcc -O2 -Wall -pthread -o prodcons_bench prodcons_bench.c
+ * Uso:      ./prodcons_bench [-p productores] [-c consumidores] [-n elementos]
+ *                            [-b] [-P] [-t segundos] [-d dispositivo]
+ *
+ *   -p N   Hilos (o procesos) productores (por defecto 1)
+ *   -c M   Hilos (o procesos) consumidores (por defecto 1)
+ *   -n K   Elementos totales a insertar (por defecto 10000)
+ *   -b     El modulo esta cargado con mode=broadcast: cada consumidor debe
+ *          recibir todos los elementos
+ *   -P     Usar procesos (fork) en lugar de hilos
+ *   -t S   Segundos maximos a esperar a que se consuma todo (por defecto 30)
+ *   -d D   Dispositivo (por defecto /dev/prodcons)
+ *
+ * Cada elemento es un identificador unico, asi que al final se comprueba que
+ * todos se han recibido exactamente una vez (o M veces en broadcast). Se
+ * informa del ritmo en elementos/s, de los percentiles de latencia (desde
+ * justo antes del write() hasta que el consumidor lo lee) y del reparto entre
+ * consumidores. Con los mismos parametros la ejecucion es repetible, de modo
+ * que sirve para comparar cambios en la implementacion de la cola.
+ *
+ * El modulo debe estar cargado con nr_reducers=0: los hilos reductores del
+ * kernel consumirian elementos que el benchmark nunca llegaria a ver.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_DEVICE "/dev/prodcons"
+#define POISON -1   /* Valor que indica a un consumidor que debe terminar */
+#define MAX_LINE 32
+
+/* Estado compartido entre hilos o procesos (siempre en memoria MAP_SHARED) */
+struct bench_shared {
+    pthread_barrier_t start;    /* Todos los trabajadores arrancan a la vez */
+    long long t_start;          /* ns en que se abre la barrera */
+    long long t_last;           /* ns de la ultima recepcion */
+    long received;              /* Recepciones de elementos validos */
+    long overruns;              /* Elementos perdidos notificados en broadcast */
+    long unknown;               /* Lecturas que no corresponden a ningun elemento */
+    long nr_lat;                /* Entradas usadas de lat_ns */
+};
+
+static struct bench_shared *sh;
+static long long *sent_ns;      /* Instante de envio de cada elemento */
+static int *seen;               /* Veces que se ha recibido cada elemento */
+static long long *lat_ns;       /* Latencias de todas las recepciones */
+static long lat_cap;            /* Capacidad de lat_ns (recepciones esperadas) */
+static long *per_consumer;      /* Elementos recibidos por cada consumidor */
+
+static const char *device = DEFAULT_DEVICE;
+static int nr_producers = 1;
+static int nr_consumers = 1;
+static long nr_items = 10000;
+static int broadcast = 0;
+static int use_procs = 0;
+static int timeout_s = 30;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *shared_alloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Escribe un elemento; pwrite en 0 porque el modulo solo acepta *off == 0 */
+static int put_item(int fd, long id) {
+    char buf[MAX_LINE];
+    int len = snprintf(buf, sizeof(buf), "%ld\n", id);
+
+    if (pwrite(fd, buf, len, 0) < 0) {
+        perror("Error escribiendo en el dispositivo");
+        return -1;
+    }
+    return 0;
+}
+
+static void producer(int idx) {
+    long first = nr_items * idx / nr_producers;
+    long last = nr_items * (idx + 1) / nr_producers;
+    long id;
+    int fd = open(device, O_WRONLY);
+
+    if (fd < 0) {
+        perror("No se pudo abrir el dispositivo");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&sh->start);
+
+    for (id = first; id < last; id++) {
+        sent_ns[id] = now_ns();
+        if (put_item(fd, id))
+            break;
+    }
+
+    close(fd);
+}
+
+static void consumer(int idx, int fd) {
+    char buf[MAX_LINE];
+    long id;
+    unsigned long lost;
+    ssize_t n;
+    long long t;
+    long slot;
+
+    pthread_barrier_wait(&sh->start);
+
+    for (;;) {
+        /* pread en 0: en fifo/prio el modulo devuelve EOF si *off > 0 */
+        n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error leyendo del dispositivo");
+            break;
+        }
+        if (n == 0)
+            continue;
+
+        t = now_ns();
+        buf[n] = '\0';
+
+        if (sscanf(buf, "overrun %lu", &lost) == 1) {
+            __atomic_add_fetch(&sh->overruns, lost, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (sscanf(buf, "%ld", &id) != 1 || id < POISON || id >= nr_items) {
+            __atomic_add_fetch(&sh->unknown, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (id == POISON)
+            break;
+
+        slot = __atomic_fetch_add(&sh->nr_lat, 1, __ATOMIC_RELAXED);
+        if (slot < lat_cap)
+            lat_ns[slot] = t - sent_ns[id];
+        __atomic_add_fetch(&seen[id], 1, __ATOMIC_RELAXED);
+        per_consumer[idx]++;
+        __atomic_store_n(&sh->t_last, t, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->received, 1, __ATOMIC_RELEASE);
+    }
+
+    close(fd);
+}
+
+/* Rol e indice de cada trabajador, sea hilo o proceso */
+struct worker_arg {
+    int consumer;
+    int idx;
+    int fd;
+};
+
+static void run_worker(struct worker_arg *w) {
+    if (w->consumer)
+        consumer(w->idx, w->fd);
+    else
+        producer(w->idx);
+}
+
+static void *worker_thread(void *arg) {
+    run_worker(arg);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(long n, double p) {
+    long i;
+
+    if (n == 0)
+        return 0.0;
+    i = (long)(p * (n - 1));
+    return lat_ns[i] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-p productores] [-c consumidores] [-n elementos] "
+            "[-b] [-P] [-t segundos] [-d dispositivo]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct worker_arg *args;
+    pthread_t *threads = NULL;
+    pid_t *pids = NULL;
+    pthread_barrierattr_t battr;
+    long expected, missing = 0, dups = 0, i, nr_lat;
+    long min_c, max_c;
+    double sum_c = 0.0, sum_c2 = 0.0, elapsed;
+    int nr_workers, fd, opt, w;
+    long long deadline;
+
+    while ((opt = getopt(argc, argv, "p:c:n:bPt:d:")) != -1) {
+        switch (opt) {
+        case 'p': nr_producers = atoi(optarg); break;
+        case 'c': nr_consumers = atoi(optarg); break;
+        case 'n': nr_items = atol(optarg); break;
+        case 'b': broadcast = 1; break;
+        case 'P': use_procs = 1; break;
+        case 't': timeout_s = atoi(optarg); break;
+        case 'd': device = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (nr_producers <= 0 || nr_consumers <= 0 || nr_items <= 0 || timeout_s <= 0)
+        usage(argv[0]);
+
+    expected = broadcast ? nr_items * nr_consumers : nr_items;
+    nr_workers = nr_producers + nr_consumers;
+
+    sh = shared_alloc(sizeof(struct bench_shared));
+    sent_ns = shared_alloc(nr_items * sizeof(long long));
+    seen = shared_alloc(nr_items * sizeof(int));
+    lat_cap = expected;
+    lat_ns = shared_alloc(lat_cap * sizeof(long long));
+    per_consumer = shared_alloc(nr_consumers * sizeof(long));
+
+    /* El hilo principal tambien espera en la barrera para tomar t_start */
+    pthread_barrierattr_init(&battr);
+    pthread_barrierattr_setpshared(&battr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&sh->start, &battr, nr_workers + 1);
+
+    args = calloc(nr_workers, sizeof(struct worker_arg));
+    if (use_procs)
+        pids = calloc(nr_workers, sizeof(pid_t));
+    else
+        threads = calloc(nr_workers, sizeof(pthread_t));
+
+    /*
+     * Los consumidores abren el dispositivo antes de la barrera: en broadcast
+     * un lector solo ve lo insertado despues de su open().
+     */
+    for (w = 0; w < nr_workers; w++) {
+        args[w].consumer = w >= nr_producers;
+        args[w].idx = args[w].consumer ? w - nr_producers : w;
+        args[w].fd = -1;
+
+        if (args[w].consumer) {
+            args[w].fd = open(device, O_RDONLY);
+            if (args[w].fd < 0) {
+                perror("No se pudo abrir el dispositivo");
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (use_procs) {
+            pids[w] = fork();
+            if (pids[w] < 0) {
+                perror("fork");
+                return EXIT_FAILURE;
+            }
+            if (pids[w] == 0) {
+                run_worker(&args[w]);
+                _exit(EXIT_SUCCESS);
+            }
+            /* El padre no necesita el descriptor del consumidor */
+            if (args[w].fd >= 0)
+                close(args[w].fd);
+        } else if (pthread_create(&threads[w], NULL, worker_thread, &args[w])) {
+            perror("Error creando hilo");
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_barrier_wait(&sh->start);
+    sh->t_start = now_ns();
+
+    /* Esperar a los productores */
+    for (w = 0; w < nr_producers; w++) {
+        if (use_procs)
+            waitpid(pids[w], NULL, 0);
+        else
+            pthread_join(threads[w], NULL);
+    }
+
+    /* Esperar a que se consuma todo o a que venza el plazo */
+    deadline = now_ns() + (long long)timeout_s * 1000000000LL;
+    while (__atomic_load_n(&sh->received, __ATOMIC_ACQUIRE) +
+           __atomic_load_n(&sh->overruns, __ATOMIC_RELAXED) < expected) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "Tiempo agotado esperando a los consumidores\n");
+            break;
+        }
+        usleep(1000);
+    }
+
+    /* Un elemento de fin por consumidor (en broadcast todos ven el mismo) */
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        perror("No se pudo abrir el dispositivo");
+        return EXIT_FAILURE;
+    }
+    for (w = 0; w < (broadcast ? 1 : nr_consumers); w++)
+        put_item(fd, POISON);
+    close(fd);
+
+    for (w = nr_producers; w < nr_workers; w++) {
+        if (use_procs)
+            waitpid(pids[w], NULL, 0);
+        else
+            pthread_join(threads[w], NULL);
+    }
+
+    /* Verificacion: cada elemento exactamente una vez (o M veces en broadcast) */
+    for (i = 0; i < nr_items; i++) {
+        int want = broadcast ? nr_consumers : 1;
+        if (seen[i] < want)
+            missing += want - seen[i];
+        else if (seen[i] > want)
+            dups += seen[i] - want;
+    }
+
+    nr_lat = sh->nr_lat < lat_cap ? sh->nr_lat : lat_cap;
+    qsort(lat_ns, nr_lat, sizeof(long long), cmp_ll);
+
+    min_c = max_c = per_consumer[0];
+    for (w = 0; w < nr_consumers; w++) {
+        if (per_consumer[w] < min_c)
+            min_c = per_consumer[w];
+        if (per_consumer[w] > max_c)
+            max_c = per_consumer[w];
+        sum_c += per_consumer[w];
+        sum_c2 += (double)per_consumer[w] * per_consumer[w];
+    }
+
+    elapsed = (sh->t_last - sh->t_start) / 1e9;
+
+    printf("dispositivo:   %s (%s, %s)\n", device, broadcast ? "broadcast" : "fifo/prio",
+           use_procs ? "procesos" : "hilos");
+    printf("productores:   %d\n", nr_producers);
+    printf("consumidores:  %d\n", nr_consumers);
+    printf("elementos:     %ld (recepciones esperadas %ld)\n", nr_items, expected);
+    printf("recibidos:     %ld en %.3f s\n", sh->received, elapsed);
+    printf("ritmo:         %.0f elementos/s\n", elapsed > 0 ? sh->received / elapsed : 0.0);
+    printf("latencia (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           percentile_us(nr_lat, 0.50), percentile_us(nr_lat, 0.90),
+           percentile_us(nr_lat, 0.99), percentile_us(nr_lat, 0.999),
+           percentile_us(nr_lat, 1.0));
+    printf("reparto:       min %ld  max %ld  media %.1f  indice de Jain %.3f\n",
+           min_c, max_c, sum_c / nr_consumers,
+           sum_c2 > 0 ? (sum_c * sum_c) / (nr_consumers * sum_c2) : 0.0);
+    printf("perdidos:      %ld (overruns notificados %ld)\n", missing, sh->overruns);
+    printf("duplicados:    %ld\n", dups);
+    printf("desconocidos:  %ld\n", sh->unknown);
+
+    if (missing || dups || sh->unknown) {
+        printf("RESULTADO: FALLO\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("RESULTADO: OK\n");
+    return EXIT_SUCCESS;
+}